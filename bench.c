@@ -0,0 +1,350 @@
+/*
+ * nuvoicp - microbenchmarks
+ *
+ * Times the ICP primitives and whole image operations against a backend,
+ * the simulated target by default, and compares the results with stored
+ * baselines. "make bench" builds and runs it.
+ *
+ * The primitives are timed on the host clock, that is the CPU cost per
+ * bit or byte on top of the delays, and on the backend clock, the rate
+ * on the wire. The image operations are timed on the backend clock and
+ * scaled to 16 KB. On the simulator everything but the host clock
+ * figures is exactly reproducible, so those get a tight tolerance in the
+ * baseline file and the host clock figures are for information only.
+ *
+ * Baseline file lines are "<metric> <value> <tolerance in %>", a "-"
+ * as tolerance reports the metric without checking it.
+ *
+ * Distributed under the same terms as nuvoicp.c, see there.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "pgm.h"
+#include "icp.h"
+#include "image.h"
+#include "perf.h"
+#include "timing.h"
+#include "ctx.h"
+
+#define BENCH_BITSEND_FRAMES	2048
+#define BENCH_BYTES		4096
+#define BENCH_TOLERANCE		2	/* % for reproducible metrics */
+#define BENCH_REF_SIZE		(16 * 1024)
+
+enum {
+	M_BITSEND_BITS,
+	M_BITSEND_WIRE,
+	M_BITSEND_CALLS,
+	M_READ_BYTES,
+	M_READ_WIRE,
+	M_READ_CALLS,
+	M_WRITE_BYTES,
+	M_WRITE_WIRE,
+	M_WRITE_CALLS,
+	M_PROGRAM_S,
+	M_PROGRAM_CALLS,
+	M_VERIFY_S,
+	M_READ_S,
+	M_NUM,
+};
+
+struct bench_metric {
+	const char *name;
+	const char *unit;
+	int higher_better;
+	int host;		/* host clock, not reproducible */
+	double value;
+	double baseline;
+	double tolerance;	/* <0 if not checked */
+};
+
+static struct bench_metric metrics[M_NUM] = {
+	[M_BITSEND_BITS]	= { "bitsend_bits_per_s",		"bit/s",	1, 1 },
+	[M_BITSEND_WIRE]	= { "bitsend_wire_bits_per_s",		"bit/s",	1, 0 },
+	[M_BITSEND_CALLS]	= { "bitsend_gpio_calls_per_bit",	"calls/bit",	0, 0 },
+	[M_READ_BYTES]		= { "read_byte_bytes_per_s",		"B/s",		1, 1 },
+	[M_READ_WIRE]		= { "read_byte_wire_bytes_per_s",	"B/s",		1, 0 },
+	[M_READ_CALLS]		= { "read_byte_gpio_calls_per_byte",	"calls/B",	0, 0 },
+	[M_WRITE_BYTES]		= { "write_byte_bytes_per_s",		"B/s",		1, 1 },
+	[M_WRITE_WIRE]		= { "write_byte_wire_bytes_per_s",	"B/s",		1, 0 },
+	[M_WRITE_CALLS]		= { "write_byte_gpio_calls_per_byte",	"calls/B",	0, 0 },
+	[M_PROGRAM_S]		= { "image_program_s_per_16k",		"s",		0, 0 },
+	[M_PROGRAM_CALLS]	= { "image_program_gpio_calls_per_byte", "calls/B",	0, 0 },
+	[M_VERIFY_S]		= { "image_verify_s_per_16k",		"s",		0, 0 },
+	[M_READ_S]		= { "image_read_s_per_16k",		"s",		0, 0 },
+};
+
+static void usage(void)
+{
+	fprintf(stderr,
+		"nuvoicp-bench, ICP microbenchmarks\n\n"
+		"Usage:\n"
+		"\t[-b <backend>[:<args>] backend to run against, default sim]\n"
+		"\t[-B <file> compare with the baselines in <file>, fail on regressions]\n"
+		"\t[-u write the results to the -B file as new baselines instead]\n");
+	exit(1);
+}
+
+static double bench_secs(uint64_t ns)
+{
+	return ns / 1e9;
+}
+
+/* 24 bit frames, each a CID read which is ended right away */
+static void bench_bitsend(void)
+{
+	uint64_t host_ns = 0, wire_ns = 0, calls = 0;
+
+	for (int i = 0; i < BENCH_BITSEND_FRAMES; i++) {
+		uint64_t c = perf_cur->gpio_calls, t = timing_now_ns(), w = pgm_now_ns();
+
+		icp_bitsend(CMD_READ_CID, 24);
+		host_ns += timing_now_ns() - t;
+		wire_ns += pgm_now_ns() - w;
+		calls += perf_cur->gpio_calls - c;
+
+		icp_read_byte(1);
+	}
+
+	metrics[M_BITSEND_BITS].value = BENCH_BITSEND_FRAMES * 24 / bench_secs(host_ns);
+	metrics[M_BITSEND_WIRE].value = BENCH_BITSEND_FRAMES * 24 / bench_secs(wire_ns);
+	metrics[M_BITSEND_CALLS].value = (double)calls / (BENCH_BITSEND_FRAMES * 24);
+}
+
+static void bench_read_byte(void)
+{
+	uint64_t c, t, w;
+
+	icp_send_command(CMD_APROM_BYTE_READ, 0);
+
+	c = perf_cur->gpio_calls;
+	t = timing_now_ns();
+	w = pgm_now_ns();
+	for (int i = 0; i < BENCH_BYTES; i++)
+		icp_read_byte(i == BENCH_BYTES - 1);
+	t = timing_now_ns() - t;
+	w = pgm_now_ns() - w;
+	c = perf_cur->gpio_calls - c;
+
+	metrics[M_READ_BYTES].value = BENCH_BYTES / bench_secs(t);
+	metrics[M_READ_WIRE].value = BENCH_BYTES / bench_secs(w);
+	metrics[M_READ_CALLS].value = (double)c / BENCH_BYTES;
+}
+
+/* one burst into erased flash, with the real program delays */
+static void bench_write_byte(const uint8_t *data)
+{
+	uint64_t c, t, w;
+
+	icp_mass_erase();
+	icp_send_command(CMD_APROM_BYTE_WRITE, 0);
+
+	c = perf_cur->gpio_calls;
+	t = timing_now_ns();
+	w = pgm_now_ns();
+	for (int i = 0; i < BENCH_BYTES; i++)
+		icp_write_byte(data[i], i == BENCH_BYTES - 1,
+			       icp_dev->prog_delay1_us, icp_dev->prog_delay2_us);
+	t = timing_now_ns() - t;
+	w = pgm_now_ns() - w;
+	c = perf_cur->gpio_calls - c;
+
+	metrics[M_WRITE_BYTES].value = BENCH_BYTES / bench_secs(t);
+	metrics[M_WRITE_WIRE].value = BENCH_BYTES / bench_secs(w);
+	metrics[M_WRITE_CALLS].value = (double)c / BENCH_BYTES;
+}
+
+/* erase, program and verify, verify again and read back the whole APROM */
+static int bench_image(const struct image *img, uint32_t size)
+{
+	double scale = (double)BENCH_REF_SIZE / size;
+	uint8_t buf[ICP_MAX_FLASH_SIZE];
+	struct perf_counters pc;
+	uint64_t t;
+
+	perf_reset();
+	t = pgm_now_ns();
+	icp_mass_erase();
+	if (icp_program_image(img, APROM_FLASH_ADDR, size, APROM_FLASH_ADDR, 0) < 0)
+		return -1;
+	metrics[M_PROGRAM_S].value = bench_secs(pgm_now_ns() - t) * scale;
+	perf_total(&pc);
+	metrics[M_PROGRAM_CALLS].value = (double)pc.gpio_calls / size;
+
+	t = pgm_now_ns();
+	if (icp_verify_image(img, APROM_FLASH_ADDR, size, APROM_FLASH_ADDR) < 0)
+		return -1;
+	metrics[M_VERIFY_S].value = bench_secs(pgm_now_ns() - t) * scale;
+
+	t = pgm_now_ns();
+	icp_aprom_byte_read(APROM_FLASH_ADDR, size, buf);
+	metrics[M_READ_S].value = bench_secs(pgm_now_ns() - t) * scale;
+
+	return memcmp(buf, img->segs[0].data, size) ? -1 : 0;
+}
+
+static int baseline_load(const char *path)
+{
+	char line[256];
+	FILE *f = fopen(path, "r");
+
+	if (!f)
+		return -1;
+
+	while (fgets(line, sizeof(line), f)) {
+		char name[64], tol[16];
+		double value;
+
+		if (line[0] == '#' || sscanf(line, "%63s %lf %15s", name, &value, tol) != 3)
+			continue;
+
+		for (int m = 0; m < M_NUM; m++) {
+			if (strcmp(name, metrics[m].name))
+				continue;
+			metrics[m].baseline = value;
+			metrics[m].tolerance = strcmp(tol, "-") ? atof(tol) : -1;
+		}
+	}
+
+	fclose(f);
+	return 0;
+}
+
+static int baseline_save(const char *path, const char *backend)
+{
+	FILE *f = fopen(path, "w");
+
+	if (!f) {
+		fprintf(stderr, "Writing %s failed\n", path);
+		return -1;
+	}
+
+	fprintf(f, "# nuvoicp-bench baselines for %s, <metric> <value> <tolerance %%|->\n"
+		"# \"-\": host clock, for information only, never a regression\n",
+		backend);
+	for (int m = 0; m < M_NUM; m++) {
+		if (metrics[m].host)
+			fprintf(f, "%s %.6g -\n", metrics[m].name, metrics[m].value);
+		else
+			fprintf(f, "%s %.6g %d\n", metrics[m].name, metrics[m].value, BENCH_TOLERANCE);
+	}
+
+	return fclose(f);
+}
+
+/* print the results, returns the number of regressions */
+static int bench_report(void)
+{
+	int regressions = 0;
+
+	for (int m = 0; m < M_NUM; m++) {
+		struct bench_metric *bm = &metrics[m];
+		double delta = bm->baseline ? (bm->value / bm->baseline - 1) * 100 : 0;
+		int bad = 0;
+
+		if (bm->baseline && bm->tolerance >= 0)
+			bad = bm->higher_better ? delta < -bm->tolerance : delta > bm->tolerance;
+		regressions += bad;
+
+		printf("%-36s %14.6g %-9s", bm->name, bm->value, bm->unit);
+		if (bm->baseline)
+			printf(" baseline %.6g (%+.1f%%)%s", bm->baseline, delta,
+			       bad ? " REGRESSION" : "");
+		printf("\n");
+	}
+
+	return regressions;
+}
+
+int main(int argc, char *argv[])
+{
+	const char *backend = "sim", *baseline = NULL;
+	uint8_t data[ICP_MAX_FLASH_SIZE];
+	struct image_seg seg;
+	struct image img = { .segs = &seg, .num_segs = 1, .max_segs = 1 };
+	const struct icp_device *dev;
+	struct ctx *ctx;
+	uint32_t x = 0x12345678;
+	int opt, update = 0, ret = 0;
+
+	while ((opt = getopt(argc, argv, "b:B:u")) != -1) {
+		switch (opt) {
+		case 'b':
+			backend = optarg;
+			break;
+		case 'B':
+			baseline = optarg;
+			break;
+		case 'u':
+			update = 1;
+			break;
+		default:
+			usage();
+		}
+	}
+
+	for (int m = 0; m < M_NUM; m++)
+		metrics[m].tolerance = -1;
+	if (baseline && !update && baseline_load(baseline) < 0)
+		fprintf(stderr, "No baselines in %s, only reporting\n", baseline);
+
+	ctx = ctx_new();
+	if (!ctx)
+		return 1;
+	ctx_use(ctx);
+
+	if (pgm_select(backend) < 0 || pgm_init() < 0) {
+		ctx_free(ctx);
+		return 1;
+	}
+
+	perf_reset();
+	icp_init();
+
+	dev = icp_find_device(icp_read_device_id());
+	if (!dev) {
+		fprintf(stderr, "No supported target found\n");
+		ret = 1;
+		goto out;
+	}
+	icp_dev = dev;
+
+	/* xorshift, no 0xff so blank skipping does not kick in */
+	for (int i = 0; i < sizeof(data); i++) {
+		x ^= x << 13;
+		x ^= x >> 17;
+		x ^= x << 5;
+		data[i] = x % 0xff;
+	}
+	seg = (struct image_seg) {
+		.addr = APROM_FLASH_ADDR, .len = dev->flash_size, .cap = dev->flash_size, .data = data,
+	};
+
+	bench_bitsend();
+	bench_read_byte();
+	bench_write_byte(data);
+	if (bench_image(&img, dev->flash_size) < 0) {
+		fprintf(stderr, "Image did not verify, results are meaningless\n");
+		ret = 1;
+		goto out;
+	}
+
+	printf("nuvoicp-bench on %s, %s\n", backend, dev->name);
+	if (bench_report()) {
+		fprintf(stderr, "Performance regressed past the baselines in %s\n", baseline);
+		ret = 1;
+	}
+	if (update && baseline)
+		ret = baseline_save(baseline, backend) < 0;
+
+out:
+	icp_exit();
+	pgm_deinit();
+	ctx_free(ctx);
+	return ret;
+}
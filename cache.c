@@ -0,0 +1,162 @@
+/*
+ * nuvoicp - UID keyed programming cache
+ *
+ * A text file with one line per unit: the UID and a hash of the images
+ * that were last programmed into it and verified. A unit whose UID is
+ * listed with the hash of the images at hand is only checked with a few
+ * short read backs spread over APROM and LDROM, plus CONFIG, and is not
+ * erased or programmed again when they all match. Anything else, a new
+ * unit, another image or a failed sample, gets the full run.
+ *
+ * Distributed under the same terms as nuvoicp.c, see there.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+
+#include "cache.h"
+#include "image.h"
+#include "log.h"
+
+#define CACHE_LINE_MAX	64
+
+static const char *cache_path;
+static pthread_mutex_t store_lock = PTHREAD_MUTEX_INITIALIZER;
+
+void cache_set_path(const char *path)
+{
+	cache_path = path;
+}
+
+int cache_enabled(void)
+{
+	return cache_path != NULL;
+}
+
+/* hash of everything a run would program, ldrom may be NULL */
+uint64_t cache_hash(const struct image *aprom, const struct image *ldrom)
+{
+	uint64_t hash = image_hash(aprom, IMAGE_HASH_INIT);
+
+	if (ldrom && ldrom != aprom)
+		hash = image_hash(ldrom, hash);
+
+	return hash;
+}
+
+static void uid_str(const uint8_t *uid, char *buf)
+{
+	for (int i = 0; i < ICP_UID_LEN; i++)
+		sprintf(&buf[2 * i], "%02x", uid[i]);
+}
+
+/* 0 and the hash in *hash if the unit is listed, -1 otherwise */
+static int cache_lookup(const uint8_t *uid, uint64_t *hash)
+{
+	char key[2 * ICP_UID_LEN + 1], line[CACHE_LINE_MAX];
+	int ret = -1;
+	FILE *f;
+
+	f = fopen(cache_path, "r");
+	if (!f)
+		return -1;
+
+	uid_str(uid, key);
+	while (fgets(line, sizeof(line), f)) {
+		unsigned long long h;
+		char k[2 * ICP_UID_LEN + 1];
+
+		if (sscanf(line, "%24s %llx", k, &h) == 2 && !strcmp(k, key)) {
+			*hash = h;
+			ret = 0;
+		}
+	}
+
+	fclose(f);
+	return ret;
+}
+
+/*
+ * 1 if the unit is listed with hash and samples of the images read back
+ * right, from where the chip CONFIG puts APROM and LDROM. ldrom is the
+ * image whose LDROM_IMAGE_ADDR window goes to LDROM, it may be aprom.
+ */
+int cache_check(const uint8_t *uid, uint64_t hash, const struct image *aprom,
+		const struct image *ldrom)
+{
+	uint8_t cfg[CFG_FLASH_LEN], want[CFG_FLASH_LEN];
+	struct icp_layout layout;
+	uint32_t ldrom_size = 0;
+	uint64_t cached;
+
+	if (cache_lookup(uid, &cached) < 0 || cached != hash)
+		return 0;
+
+	/* CONFIG as the run that stored the unit left it */
+	icp_read_config(cfg);
+	memcpy(want, cfg, sizeof(want));
+	if (ldrom && image_bytes(ldrom, LDROM_IMAGE_ADDR, LDROM_MAX_SIZE)) {
+		int size = icp_ldrom_size(ldrom);
+
+		if (size < 0)
+			return 0;
+		ldrom_size = size;
+	}
+	icp_image_config(aprom, ldrom_size, want);
+	if (memcmp(cfg, want, CFG_FLASH_LEN))
+		return 0;
+	icp_decode_config(cfg, &layout);
+
+	if (icp_sample_verify(aprom, APROM_FLASH_ADDR, layout.aprom_size, APROM_FLASH_ADDR,
+			      CACHE_SAMPLES) < 0)
+		return 0;
+
+	if (ldrom && image_bytes(ldrom, LDROM_IMAGE_ADDR, LDROM_MAX_SIZE)) {
+		if (image_bytes(ldrom, LDROM_IMAGE_ADDR + layout.ldrom_size,
+				LDROM_MAX_SIZE - layout.ldrom_size))
+			return 0;
+		if (icp_sample_verify(ldrom, LDROM_IMAGE_ADDR, layout.ldrom_size, layout.aprom_size,
+				      CACHE_SAMPLES) < 0)
+			return 0;
+	}
+
+	return 1;
+}
+
+/* list the unit with hash, replacing its old entry */
+void cache_store(const uint8_t *uid, uint64_t hash)
+{
+	char key[2 * ICP_UID_LEN + 1], line[CACHE_LINE_MAX], tmp[4096];
+	FILE *in, *out;
+
+	uid_str(uid, key);
+	snprintf(tmp, sizeof(tmp), "%s.tmp", cache_path);
+
+	/* sockets of the scheduler store from their own threads */
+	pthread_mutex_lock(&store_lock);
+	out = fopen(tmp, "w");
+	if (!out) {
+		log_err("Writing %s failed: %s\n", tmp, strerror(errno));
+		pthread_mutex_unlock(&store_lock);
+		return;
+	}
+
+	in = fopen(cache_path, "r");
+	while (in && fgets(line, sizeof(line), in)) {
+		if (strncmp(line, key, strlen(key)) || line[strlen(key)] != ' ')
+			fputs(line, out);
+	}
+	if (in)
+		fclose(in);
+
+	fprintf(out, "%s %016llx\n", key, (unsigned long long)hash);
+
+	/* a half written index must never be picked up, write aside and rename */
+	if (fclose(out) || rename(tmp, cache_path) < 0)
+		log_err("Writing %s failed: %s\n", cache_path, strerror(errno));
+	pthread_mutex_unlock(&store_lock);
+}
@@ -0,0 +1,26 @@
+/*
+ * nuvoicp - UID keyed programming cache
+ *
+ * Distributed under the same terms as nuvoicp.c, see there.
+ */
+
+#ifndef CACHE_H
+#define CACHE_H
+
+#include <stdint.h>
+
+#include "icp.h"
+
+/* read back runs per region before a cached unit is trusted */
+#define CACHE_SAMPLES	16
+
+struct image;
+
+void cache_set_path(const char *path);
+int cache_enabled(void);
+uint64_t cache_hash(const struct image *aprom, const struct image *ldrom);
+int cache_check(const uint8_t *uid, uint64_t hash, const struct image *aprom,
+		const struct image *ldrom);
+void cache_store(const uint8_t *uid, uint64_t hash);
+
+#endif
@@ -0,0 +1,52 @@
+/*
+ * nuvoicp - per target context
+ *
+ * The modules keep the state of a target in a struct ctx rather than in
+ * globals: the backend and its lines, the ICP and timing state, the perf
+ * counters, the journal and the log. Code below the library entry points
+ * reaches it through ctx_cur, which each thread points at the context it
+ * is working on. The command line tool, each scheduler worker and each
+ * open library handle have a context of their own, so any number of
+ * targets can be driven from one thread or from many.
+ *
+ * Distributed under the same terms as nuvoicp.c, see there.
+ */
+
+#include <stdlib.h>
+
+#include "ctx.h"
+
+_Thread_local struct ctx *ctx_cur;
+
+/* a context with the defaults, not in use by any thread yet */
+struct ctx *ctx_new(void)
+{
+	struct ctx *c = calloc(1, sizeof(*c));
+
+	if (!c)
+		return NULL;
+
+	perf_ctx_init(&c->perf);
+	timing_ctx_init(&c->timing);
+	pgm_ctx_init(&c->pgm);
+	icp_ctx_init(&c->icp);
+
+	return c;
+}
+
+void ctx_free(struct ctx *c)
+{
+	free(c);
+}
+
+/*
+ * Work on c from now on, returns the context used so far so it can be
+ * put back. A context must not be in use by two threads at once.
+ */
+struct ctx *ctx_use(struct ctx *c)
+{
+	struct ctx *prev = ctx_cur;
+
+	ctx_cur = c;
+	return prev;
+}
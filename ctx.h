@@ -0,0 +1,34 @@
+/*
+ * nuvoicp - per target context
+ *
+ * Distributed under the same terms as nuvoicp.c, see there.
+ */
+
+#ifndef CTX_H
+#define CTX_H
+
+#include "log.h"
+#include "perf.h"
+#include "timing.h"
+#include "pgm.h"
+#include "icp.h"
+#include "journal.h"
+
+/* everything that belongs to one target, its transport and its log */
+struct ctx {
+	struct log_state log;
+	struct perf_state perf;
+	struct timing_state timing;
+	struct pgm_state pgm;
+	struct icp_state icp;
+	struct journal_state journal;
+};
+
+/* the context the calling thread works on, see ctx_use() */
+extern _Thread_local struct ctx *ctx_cur;
+
+struct ctx *ctx_new(void);
+void ctx_free(struct ctx *c);
+struct ctx *ctx_use(struct ctx *c);
+
+#endif
@@ -0,0 +1,222 @@
+/*
+ * nuvoicp - programming daemon
+ *
+ * Keeps the backend session and the images resident and takes jobs from a
+ * Unix domain stream socket, one request per line. Every request gets one
+ * line with a JSON object back, "status" is "ok" or "error".
+ *
+ *   identify                    CID, device ID and UID of the target
+ *   load <file>                 read <file> into the image cache
+ *   program <file> [ldrom=<file>] [diff] [pageverify]
+ *                               program APROM and optionally LDROM
+ *   verify <file>               compare APROM with <file>
+ *   read <file>                 save the whole flash to <file>
+ *   erase                       erase the whole chip
+ *   quit                        stop the daemon
+ *
+ * Images are loaded on first use and reloaded when the file changes on
+ * disk. Every job starts with a short reset into ICP mode and ends with
+ * the target released from reset, so units can be swapped between jobs.
+ * Clients are served one after the other, there is only one target.
+ * Performance counters, if requested, are written after every job that
+ * talked to the target. With a programming cache (-C), program skips
+ * units that already hold the image and replies "cached":true.
+ *
+ * Distributed under the same terms as nuvoicp.c, see there.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <signal.h>
+#include <errno.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+#include "icp.h"
+#include "session.h"
+#include "daemon.h"
+#include "job.h"
+#include "log.h"
+#include "image.h"
+#include "timing.h"
+#include "perf.h"
+
+#define DAEMON_MAX_IMAGES	8
+#define DAEMON_MAX_LINE		1024
+
+struct cached_image {
+	char *path;
+	uint32_t raw_addr;
+	time_t mtime;
+	off_t size;
+	unsigned int gen;		/* last job that got it */
+	struct image img;
+};
+
+static struct cached_image images[DAEMON_MAX_IMAGES];
+static int next_image;
+static unsigned int job_gen;
+static volatile sig_atomic_t quit;
+
+/* the target of the running job */
+static struct icp_session session;
+
+/*
+ * The cached image for path, (re)loaded if it is new or changed on disk.
+ * Raw binaries are placed at raw_addr, so that is part of the key. An
+ * image the current job already got is neither evicted nor reloaded, the
+ * job holds on to it until it ends.
+ */
+static const struct image *image_get(const char *path, uint32_t raw_addr)
+{
+	struct cached_image *ci = NULL;
+	struct stat st;
+
+	if (stat(path, &st) < 0)
+		return NULL;
+
+	for (int i = 0; i < DAEMON_MAX_IMAGES; i++) {
+		if (images[i].path && !strcmp(images[i].path, path) &&
+		    images[i].raw_addr == raw_addr) {
+			ci = &images[i];
+			break;
+		}
+	}
+
+	if (ci && (ci->gen == job_gen || (ci->mtime == st.st_mtime && ci->size == st.st_size))) {
+		ci->gen = job_gen;
+		return &ci->img;
+	}
+
+	/* a job takes two images at most, far fewer than there are slots */
+	while (!ci || ci->gen == job_gen) {
+		ci = &images[next_image];
+		next_image = (next_image + 1) % DAEMON_MAX_IMAGES;
+	}
+
+	free(ci->path);
+	ci->path = NULL;
+	image_free(&ci->img);
+
+	if (image_load(&ci->img, path, raw_addr) < 0)
+		return NULL;
+
+	ci->path = strdup(path);
+	ci->raw_addr = raw_addr;
+	ci->mtime = st.st_mtime;
+	ci->size = st.st_size;
+	ci->gen = job_gen;
+
+	log_info("daemon: loaded %s (%d segments)\n", path, ci->img.num_segs);
+
+	return &ci->img;
+}
+
+static void daemon_job(char *line, struct reply *r)
+{
+	char *args[JOB_MAX_ARGS], *save = NULL;
+	int nargs = 0;
+	uint64_t start = timing_now_ns();
+	const char *err;
+	struct job job;
+
+	for (char *tok = strtok_r(line, " \t\r\n", &save); tok && nargs < JOB_MAX_ARGS;
+	     tok = strtok_r(NULL, " \t\r\n", &save))
+		args[nargs++] = tok;
+
+	perf_reset();
+	job_gen++;
+	err = job_parse(&job, args, nargs, image_get);
+	if (err) {
+		reply_error(r, &job, err);
+		goto done;
+	}
+
+	reply_start(r, &job);
+	job_run(&session, &job, r);
+	if (job.type == JOB_QUIT)
+		quit = 1;
+
+	/* let the unit run, it may be swapped before the next job */
+	if (job_uses_target(&job)) {
+		session_exit(&session);
+		perf_report();
+	}
+
+done:
+	reply_end(r, timing_now_ns() - start);
+}
+
+static void daemon_signal(int sig)
+{
+	quit = 1;
+}
+
+int daemon_run(const char *sock_path)
+{
+	struct sockaddr_un sa = { .sun_family = AF_UNIX };
+	struct sigaction act = { .sa_handler = daemon_signal };
+	char line[DAEMON_MAX_LINE];
+	struct reply r = { .tag = "" };
+	int fd;
+
+	if (strlen(sock_path) >= sizeof(sa.sun_path)) {
+		log_err("Socket path too long\n");
+		return -EINVAL;
+	}
+	strcpy(sa.sun_path, sock_path);
+
+	fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (fd < 0) {
+		log_err("Creating socket failed: %s\n", strerror(errno));
+		return -errno;
+	}
+
+	unlink(sock_path);
+	if (bind(fd, (struct sockaddr *)&sa, sizeof(sa)) < 0 || listen(fd, 4) < 0) {
+		log_err("Listening on %s failed: %s\n", sock_path, strerror(errno));
+		close(fd);
+		return -EIO;
+	}
+
+	/* no SA_RESTART, a signal has to get us out of accept() */
+	sigaction(SIGINT, &act, NULL);
+	sigaction(SIGTERM, &act, NULL);
+	signal(SIGPIPE, SIG_IGN);
+
+	log_info("daemon: waiting for jobs on %s\n", sock_path);
+
+	while (!quit) {
+		int cfd = accept(fd, NULL, NULL);
+		FILE *f;
+
+		if (cfd < 0) {
+			if (errno == EINTR)
+				continue;
+			log_err("accept() failed: %s\n", strerror(errno));
+			break;
+		}
+
+		f = fdopen(cfd, "r");
+		while (!quit && fgets(line, sizeof(line), f)) {
+			daemon_job(line, &r);
+			if (write(cfd, r.buf, r.len) != r.len)
+				break;
+		}
+		fclose(f);
+	}
+
+	close(fd);
+	unlink(sock_path);
+
+	for (int i = 0; i < DAEMON_MAX_IMAGES; i++) {
+		free(images[i].path);
+		image_free(&images[i].img);
+	}
+
+	return 0;
+}
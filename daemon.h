@@ -0,0 +1,12 @@
+/*
+ * nuvoicp - programming daemon
+ *
+ * Distributed under the same terms as nuvoicp.c, see there.
+ */
+
+#ifndef DAEMON_H
+#define DAEMON_H
+
+int daemon_run(const char *sock_path);
+
+#endif
@@ -0,0 +1,926 @@
+/*
+ * nuvoicp - ICP protocol for the Nuvoton N76E003/MS51
+ *
+ * Copyright (c) 2021 Steve Markgraf <steve@steve-m.de>
+ *
+ * Distributed under the same terms as nuvoicp.c, see there.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "icp.h"
+#include "image.h"
+#include "timing.h"
+#include "perf.h"
+#include "log.h"
+#include "wave.h"
+#include "journal.h"
+#include "ctx.h"
+
+/* the delays are defaults, a timing profile replaces them, see tune.c */
+static struct icp_device icp_devices[] = {
+	{
+		.name			= "MS51FB9AE",
+		.devid			= MS51FB9AE_DEVID,
+		.flash_size		= 16 * 1024,
+		.page_size		= 128,
+		.ldrom_step		= 1024,
+		.ldrom_max		= 4 * 1024,
+		.prog_delay1_us		= 200,
+		.prog_delay2_us		= 50,
+		.page_erase_delay1_us	= 10000,
+		.page_erase_delay2_us	= 1000,
+		.mass_erase_delay1_us	= 100000,
+		.mass_erase_delay2_us	= 10000,
+	}, {
+		.name			= "N76E003",
+		.devid			= N76E003_DEVID,
+		.flash_size		= 18 * 1024,
+		.page_size		= 128,
+		.ldrom_step		= 1024,
+		.ldrom_max		= 4 * 1024,
+		.prog_delay1_us		= 200,
+		.prog_delay2_us		= 50,
+		.page_erase_delay1_us	= 10000,
+		.page_erase_delay2_us	= 1000,
+		.mass_erase_delay1_us	= 100000,
+		.mass_erase_delay2_us	= 10000,
+	},
+};
+
+void icp_ctx_init(struct icp_state *is)
+{
+    is->dev = &icp_devices[0];
+}
+
+/* the table entry itself, for timing profiles to change its delays */
+struct icp_device *icp_tune_device(uint16_t devid)
+{
+	for (int i = 0; i < sizeof(icp_devices) / sizeof(icp_devices[0]); i++) {
+		if (icp_devices[i].devid == devid)
+			return &icp_devices[i];
+	}
+
+	return NULL;
+}
+
+/* NULL for a device ID we know nothing about */
+const struct icp_device *icp_find_device(uint16_t devid)
+{
+	return icp_tune_device(devid);
+}
+
+void icp_bitsend(uint32_t data, int len)
+{
+	/* configure DAT pin as output */
+	pgm_dat_dir(1);
+
+	/* each data bit goes out together with the previous falling edge */
+	int i = len;
+	perf_count(bits, len);
+	timing_mark_break(TIMING_HIST_BIT);
+	while (i--) {
+		pgm_set_lines(PGM_DAT | PGM_CLK, (data >> i) & 1 ? PGM_DAT : 0);
+		pgm_set_clk(1);
+		timing_mark(TIMING_HIST_BIT);
+	}
+	pgm_set_clk(0);
+}
+
+void icp_send_command(uint8_t cmd, uint32_t dat)
+{
+	uint32_t command = (dat << 6) | cmd;
+	log_trace("INFO: icp_send_command,  0x%04X\n", command);
+	timing_mark_break(TIMING_HIST_BYTE);
+	icp_bitsend(command, 24);
+}
+
+void icp_init(void)
+{
+	uint32_t icp_seq = 0x9e1cb6;
+	int i = 24;
+
+	perf_begin(PERF_ENTRY);
+
+	while (i--) {
+		pgm_set_rst((icp_seq >> i) & 1);
+		pgm_usleep(10000);
+	}
+
+	pgm_usleep(100);
+
+	icp_bitsend(0x5aa503, 24);
+	perf_end();
+}
+
+void icp_reinit(void)
+{
+    perf_begin(PERF_ENTRY);
+    pgm_set_rst(1);
+    pgm_usleep(5000);
+
+    pgm_set_rst(0);
+    pgm_usleep(1000);
+
+	icp_bitsend(0x5aa503, 24);
+    pgm_usleep(10);
+    perf_end();
+}
+
+void icp_exit(void)
+{
+	perf_begin(PERF_EXIT);
+	pgm_set_rst(1);
+	pgm_usleep(5000);
+	pgm_set_rst(0);
+	pgm_usleep(10000);
+	icp_bitsend(0xf78f0, 24);
+	pgm_usleep(500);
+	pgm_set_rst(1);
+	perf_end();
+}
+
+uint8_t icp_read_bits(void)
+{
+	pgm_dat_dir(0); // input
+
+	uint8_t data = 0;
+	int i = 8;
+
+	perf_count(bits, 8);
+	perf_count(bytes_read, 1);
+	timing_mark(TIMING_HIST_BYTE);
+	timing_mark_break(TIMING_HIST_BIT);
+	while (i--) {
+		int state = pgm_get_dat();
+		pgm_set_clk(1);
+		timing_mark(TIMING_HIST_BIT);
+//		int state = pgm_get_dat();
+		pgm_set_clk(0);
+		data |= (state << i);
+	}
+
+	return data;
+}
+
+/* the 9th clock of a read, 1 ends the burst, 0 moves on to the next byte */
+void icp_read_end(int end)
+{
+	perf_count(bits, 1);
+	pgm_dat_dir(1);
+	pgm_set_dat(end);
+	pgm_set_clk(1);
+	pgm_set_lines(PGM_DAT | PGM_CLK, 0);
+}
+
+uint8_t icp_read_byte(int end)
+{
+	uint8_t data = icp_read_bits();
+
+	icp_read_end(end);
+
+	return data;
+}
+
+void icp_write_byte(uint8_t data, int end, int delay1, int delay2)
+{
+	perf_count(bits, 1);
+	perf_count(bytes_written, 1);
+	timing_mark(TIMING_HIST_BYTE);
+	icp_bitsend(data, 8);
+	pgm_set_dat(end);
+	pgm_usleep(delay1);
+	pgm_set_clk(1);
+	pgm_usleep(delay2);
+	pgm_set_lines(PGM_DAT | PGM_CLK, 0);
+}
+
+uint32_t icp_read_device_id(void)
+{
+	perf_begin(PERF_IDENTIFY);
+	log_debug("icp_read_device_id()\n");
+	icp_send_command(CMD_READ_DEVICE_ID, 0);
+//	icp_send_command2(CMD_READ_DEVICE_ID, 0, 0);
+
+	uint8_t devid[2];
+	devid[0] = icp_read_byte(0);
+	devid[1] = icp_read_byte(1);
+
+	perf_end();
+	return (devid[1] << 8) | devid[0];
+}
+
+uint8_t icp_read_cid(void)
+{
+    perf_begin(PERF_IDENTIFY);
+    log_debug("icp_read_cid()\n");
+    icp_send_command(CMD_READ_CID, 0);
+    uint8_t cid = icp_read_byte(1);
+    perf_end();
+    return cid;
+}
+
+void icp_read_uid_bytes(uint8_t *uid)
+{
+    perf_begin(PERF_IDENTIFY);
+    icp_send_command(CMD_READ_UID, 0);
+//    icp_send_command2(CMD_READ_UID, 0, 0);
+    for (int i = 0; i < ICP_UID_LEN; i++) {
+//        icp_send_command(CMD_READ_UID, i);
+        uid[i] = icp_read_byte(i == (ICP_UID_LEN - 1));
+    }
+    perf_end();
+}
+
+uint32_t icp_read_ucid(void)
+{
+	perf_begin(PERF_IDENTIFY);
+	log_debug("icp_read_ucid()\n");
+	uint8_t ucid[4];
+
+	for (int i = 0; i < sizeof(ucid); i++) {
+		icp_send_command(CMD_READ_UID, i + 0x20);
+		ucid[i] = icp_read_byte(1);
+	}
+
+	perf_end();
+	return (ucid[3] << 24) | (ucid[2] << 16) | (ucid[1] << 8) | ucid[0];
+}
+
+uint32_t icp_aprom_byte_read(uint32_t addr, uint32_t len, uint8_t *data)
+{
+	perf_begin(PERF_READ);
+	log_debug("icp_aprom_byte_read()\n");
+	icp_send_command(CMD_APROM_BYTE_READ, addr);
+
+	for (int i = 0; i < len; i++)
+		data[i] = icp_read_byte(i == (len-1));
+
+	perf_end();
+	return addr + len;
+}
+
+/*
+ * Byte writes go out as precompiled waveforms, the command and the first
+ * chunk of bytes in one, then a chunk at a time. A chunk is a page, so
+ * there is a progress dot for every 256 bytes written, none for writes of
+ * a page or less.
+ */
+static uint32_t icp_byte_write(uint8_t cmd, uint32_t addr, uint32_t len, uint8_t *data)
+{
+    struct wave *w = &ctx_cur->icp.wave;
+    uint32_t chunk = icp_dev->page_size < WAVE_MAX_BYTES ? icp_dev->page_size : WAVE_MAX_BYTES;
+    int progress_printed = 0;
+
+    log_trace("INFO: icp_send_command,  0x%04X\n", (addr << 6) | cmd);
+    wave_reset(w);
+    wave_command(w, cmd, addr);
+
+    for (uint32_t off = 0; off < len; off += chunk) {
+        uint32_t n = len - off < chunk ? len - off : chunk;
+
+        for (uint32_t i = off; i < off + n; i++)
+            wave_write_byte(w, data[i], i == (len-1),
+                            icp_dev->prog_delay1_us, icp_dev->prog_delay2_us);
+        wave_play(w);
+        wave_reset(w);
+
+        /* print some progress */
+        for (uint32_t i = off / 256 * 256 + 256; i <= off + n; i += 256) {
+            log_info(".");
+            progress_printed++;
+        }
+    }
+
+    if (progress_printed)
+        log_info("\n");
+
+    return addr + len;
+}
+
+uint32_t icp_aprom_byte_write(uint32_t addr, uint32_t len, uint8_t *data)
+{
+    perf_begin(PERF_WRITE);
+    log_debug("icp_aprom_byte_write()\n");
+    icp_byte_write(CMD_APROM_BYTE_WRITE, addr, len, data);
+    perf_end();
+    return addr + len;
+}
+
+/*
+ * Program data into freshly erased flash with the given byte write
+ * function. Runs of 0xff already match the erased state, so only the
+ * non-blank runs are clocked out, each with its own write command.
+ * Returns the number of bytes actually written.
+ */
+uint32_t icp_byte_write_skip_blank(uint32_t (*write)(uint32_t, uint32_t, uint8_t *),
+                                   uint32_t addr, uint32_t len, uint8_t *data)
+{
+    uint32_t start = 0, written = 0;
+
+    while (start < len) {
+        uint32_t end, blank = 0;
+
+        while (start < len && data[start] == 0xff)
+            start++;
+        if (start == len)
+            break;
+
+        /* extend the run up to the next long enough stretch of 0xff */
+        end = start + 1;
+        for (uint32_t i = end; i < len && blank < BLANK_RUN_MIN; i++) {
+            if (data[i] == 0xff) {
+                blank++;
+            } else {
+                end = i + 1;
+                blank = 0;
+            }
+        }
+
+        write(addr + start, end - start, &data[start]);
+        written += end - start;
+        start = end;
+    }
+
+    return written;
+}
+
+void icp_print_blank_summary(uint32_t len, uint32_t written)
+{
+    if (written < len)
+        log_info("Skipped %u blank bytes, saved ~%u ms of write delays\n",
+                len - written, (len - written) * (icp_dev->prog_delay1_us + icp_dev->prog_delay2_us) / 1000);
+}
+
+/*
+ * Read back [addr, addr + len) with the given read command and compare
+ * every byte as it arrives. The read burst is ended right at the first
+ * mismatch. Returns 0 when everything matched, -1 otherwise.
+ */
+int icp_byte_verify(uint8_t read_cmd, uint32_t addr, uint32_t len, const uint8_t *data)
+{
+    perf_begin(PERF_VERIFY);
+    icp_send_command(read_cmd, addr);
+
+    for (uint32_t i = 0; i < len; i++) {
+        uint8_t val = icp_read_bits();
+        int bad = val != data[i];
+
+        icp_read_end(bad || i == (len-1));
+        if (bad) {
+            log_err("Verify failed at 0x%04x: read 0x%02x, expected 0x%02x\n",
+                    addr + i, val, data[i]);
+            perf_end();
+            return -1;
+        }
+    }
+
+    perf_end();
+    return 0;
+}
+
+/* one byte from every target at once, data[n] for target n */
+void icp_gang_read_bits(uint8_t *data)
+{
+    int num = pgm_num_targets();
+
+    pgm_dat_dir(0); // input
+    memset(data, 0, num);
+
+    perf_count(bits, 8);
+    perf_count(bytes_read, 1);
+    timing_mark(TIMING_HIST_BYTE);
+    timing_mark_break(TIMING_HIST_BIT);
+    for (int i = 7; i >= 0; i--) {
+        uint32_t dats = pgm_get_dats();
+
+        pgm_set_clk(1);
+        timing_mark(TIMING_HIST_BIT);
+        pgm_set_clk(0);
+        for (int n = 0; n < num; n++)
+            data[n] |= ((dats >> n) & 1) << i;
+    }
+}
+
+/* a read burst from all targets, data[i][n] is byte i of target n */
+void icp_gang_read(uint8_t cmd, uint32_t addr, uint32_t len, uint8_t data[][PGM_MAX_TARGETS])
+{
+    icp_send_command(cmd, addr);
+
+    for (uint32_t i = 0; i < len; i++) {
+        icp_gang_read_bits(data[i]);
+        icp_read_end(i == (len-1));
+    }
+}
+
+/*
+ * Verify [addr, addr + len) on the targets in mask with a single read
+ * burst. A target drops out at its first mismatch, which is recorded in
+ * gang_bad_addr, and the burst ends once no target is left. Returns the
+ * targets that matched.
+ */
+uint32_t icp_gang_byte_verify(uint8_t read_cmd, uint32_t addr, uint32_t len,
+                              const uint8_t *data, uint32_t mask)
+{
+    struct icp_state *is = &ctx_cur->icp;
+    uint8_t vals[PGM_MAX_TARGETS];
+
+    perf_begin(PERF_VERIFY);
+    icp_send_command(read_cmd, addr);
+
+    for (uint32_t i = 0; i < len; i++) {
+        icp_gang_read_bits(vals);
+
+        for (int n = 0; n < pgm_num_targets(); n++) {
+            if (!(mask & (1 << n)) || vals[n] == data[i])
+                continue;
+            log_err("Target %d: verify failed at 0x%04x: read 0x%02x, expected 0x%02x\n",
+                    n, addr + i, vals[n], data[i]);
+            is->gang_bad_addr[n] = addr + i;
+            mask &= ~(1 << n);
+        }
+
+        icp_read_end(!mask || i == (len-1));
+        if (!mask)
+            break;
+    }
+
+    perf_end();
+    return mask;
+}
+
+/* verify a range on the single target or on all targets still in the gang */
+int icp_range_verify(uint8_t read_cmd, uint32_t addr, uint32_t len, const uint8_t *data)
+{
+    struct icp_state *is = &ctx_cur->icp;
+
+    if (pgm_num_targets() == 1)
+        return icp_byte_verify(read_cmd, addr, len, data);
+
+    is->gang_live = icp_gang_byte_verify(read_cmd, addr, len, data, is->gang_live);
+
+    return is->gang_live ? 0 : -1;
+}
+
+/*
+ * Read CID, device ID and UID of all targets, one pass each, and keep the
+ * targets that answer like a supported chip. Returns the usable targets.
+ */
+uint32_t icp_gang_identify(void)
+{
+    struct icp_state *is = &ctx_cur->icp;
+    uint8_t cid[1][PGM_MAX_TARGETS], did[2][PGM_MAX_TARGETS], uid[12][PGM_MAX_TARGETS];
+
+    perf_begin(PERF_IDENTIFY);
+    log_debug("icp_gang_identify()\n");
+    icp_gang_read(CMD_READ_CID, 0, 1, cid);
+    icp_gang_read(CMD_READ_DEVICE_ID, 0, 2, did);
+    icp_gang_read(CMD_READ_UID, 0, 12, uid);
+
+    is->gang_live = 0;
+    for (int n = 0; n < pgm_num_targets(); n++) {
+        uint16_t devid = (did[1][n] << 8) | did[0][n];
+        const struct icp_device *dev = icp_find_device(devid);
+        int ok = cid[0][n] == NUVOTON_ID && dev && (!is->gang_live || dev == icp_dev);
+
+        char uid_str[ICP_UID_LEN * 3 + 1];
+
+        for (int i = 0; i < ICP_UID_LEN; i++)
+            sprintf(&uid_str[i * 3], " %02x", uid[i][n]);
+        log_info("Target %d (GPIO%d): CID 0x%02x, DID 0x%04x, UID%s%s\n",
+                 n, pgm_dat_gpios()[n], cid[0][n], devid, uid_str, ok ? "" : " - not usable");
+
+        is->gang_bad_addr[n] = -1;
+        if (!ok)
+            continue;
+
+        /* the first usable target sets the device, the gang shares one layout */
+        if (!is->gang_live)
+            icp_dev = dev;
+        is->gang_live |= 1 << n;
+    }
+
+    perf_end();
+    return is->gang_live;
+}
+
+void icp_gang_report(uint32_t found)
+{
+    struct icp_state *is = &ctx_cur->icp;
+
+    log_info("\nGang result:\n");
+    for (int n = 0; n < pgm_num_targets(); n++) {
+        if (!(found & (1 << n)))
+            log_info("  Target %d (GPIO%d): not found\n", n, pgm_dat_gpios()[n]);
+        else if (is->gang_live & (1 << n))
+            log_info("  Target %d (GPIO%d): OK\n", n, pgm_dat_gpios()[n]);
+        else
+            log_info("  Target %d (GPIO%d): FAILED at 0x%04x\n", n, pgm_dat_gpios()[n],
+                     is->gang_bad_addr[n]);
+    }
+}
+
+/* write the segments of img in [win, win + len) to erased flash at base */
+static uint32_t icp_write_image(const struct image *img, uint32_t win, uint32_t len,
+                                uint32_t base)
+{
+    uint32_t written = 0;
+
+    for (int i = 0; i < img->num_segs; i++) {
+        const struct image_seg *seg = &img->segs[i];
+        uint32_t start = seg->addr > win ? seg->addr : win;
+        uint32_t end = seg->addr + seg->len < win + len ? seg->addr + seg->len : win + len;
+
+        if (start < end)
+            written += icp_byte_write_skip_blank(icp_aprom_byte_write, base + start - win, end - start,
+                                                 &seg->data[start - seg->addr]);
+    }
+
+    return written;
+}
+
+/* verify the segments of img in [win, win + len) against flash at base */
+static int icp_check_image(const struct image *img, uint32_t win, uint32_t len, uint32_t base)
+{
+    for (int i = 0; i < img->num_segs; i++) {
+        const struct image_seg *seg = &img->segs[i];
+        uint32_t start = seg->addr > win ? seg->addr : win;
+        uint32_t end = seg->addr + seg->len < win + len ? seg->addr + seg->len : win + len;
+
+        if (start < end && icp_range_verify(CMD_APROM_BYTE_READ, base + start - win, end - start,
+                                            &seg->data[start - seg->addr]) < 0)
+            return -1;
+    }
+
+    return 0;
+}
+
+/*
+ * Verify one page worth of img and, while it does not match, erase the
+ * page and program it again, at most ICP_PAGE_RETRIES times. base is the
+ * start of the page. In a gang the retries go to all targets, the good
+ * ones are just programmed again, and targets that never verify drop
+ * out. Returns <0 if the page, or every target of the gang, failed.
+ */
+static int icp_settle_page(const struct image *img, uint32_t win, uint32_t len, uint32_t base,
+                           uint32_t *written)
+{
+    struct icp_state *is = &ctx_cur->icp;
+    uint32_t live = is->gang_live;
+
+    for (int retry = 0; ; retry++) {
+        if (icp_check_image(img, win, len, base) == 0 && is->gang_live == live)
+            return 0;
+        if (retry == ICP_PAGE_RETRIES)
+            return pgm_num_targets() > 1 && is->gang_live ? 0 : -1;
+
+        log_info("Page 0x%04x did not verify, erasing and programming it again (%d/%d)\n",
+                 base, retry + 1, ICP_PAGE_RETRIES);
+        is->gang_live = live;
+        icp_aprom_page_erase(base);
+        *written += icp_write_image(img, win, len, base);
+    }
+}
+
+/*
+ * Program the segments of img that fall into [win, win + len) into erased
+ * APROM or LDROM, at base plus their offset in the window, page by page.
+ * Gaps between segments are not touched. With page_verify each page is
+ * read back as soon as it is programmed, otherwise everything is checked
+ * at the end and only on a mismatch page by page. Pages that do not
+ * verify are retried on their own. Programmed pages go to the journal,
+ * when resuming the ones listed there are only verified and the others
+ * are erased first. Returns <0 if verification failed.
+ */
+int icp_program_image(const struct image *img, uint32_t win, uint32_t len, uint32_t base,
+                      int page_verify)
+{
+    struct icp_state *is = &ctx_cur->icp;
+    uint32_t page = icp_dev->page_size, first = base / page * page;
+    uint32_t total = 0, written = 0, live = is->gang_live;
+    int ret = 0;
+
+    for (uint32_t p = first; p < base + len && ret >= 0; p += page) {
+        uint32_t start = p > base ? p : base;
+        uint32_t n = (p + page < base + len ? p + page : base + len) - start;
+        uint32_t bytes = image_bytes(img, win + start - base, n);
+
+        if (!bytes)
+            continue;
+
+        if (!journal_page_done(p)) {
+            total += bytes;
+            if (journal_resuming())
+                icp_aprom_page_erase(p);
+            written += icp_write_image(img, win + start - base, n, start);
+            journal_page_add(p);
+        }
+
+        if (page_verify)
+            ret = icp_settle_page(img, win + start - base, n, start, &written);
+    }
+
+    /* one read burst per segment, page by page only if that finds a mismatch */
+    if (!page_verify && ret >= 0 && icp_check_image(img, win, len, base) < 0) {
+        is->gang_live = live;
+        for (uint32_t p = first; p < base + len && ret >= 0; p += page) {
+            uint32_t start = p > base ? p : base;
+            uint32_t n = (p + page < base + len ? p + page : base + len) - start;
+
+            ret = icp_settle_page(img, win + start - base, n, start, &written);
+        }
+    }
+
+    icp_print_blank_summary(total, written);
+
+    return ret;
+}
+
+/* verify the segments of img in [win, win + len) against APROM at base */
+int icp_verify_image(const struct image *img, uint32_t win, uint32_t len, uint32_t base)
+{
+    return icp_check_image(img, win, len, base);
+}
+
+/*
+ * Cheap check that APROM at base still holds img: read back samples
+ * bytes runs, spread evenly over the populated bytes of the window.
+ * Returns 0 when all of them match, -1 otherwise, quietly.
+ */
+int icp_sample_verify(const struct image *img, uint32_t win, uint32_t len, uint32_t base,
+                      int samples)
+{
+    uint32_t total = image_bytes(img, win, len), seen = 0;
+    uint8_t buf[ICP_SAMPLE_LEN];
+    int k = 0;
+
+    perf_begin(PERF_VERIFY);
+    for (int i = 0; i < img->num_segs && k < samples; i++) {
+        const struct image_seg *seg = &img->segs[i];
+        uint32_t start = seg->addr > win ? seg->addr : win;
+        uint32_t end = seg->addr + seg->len < win + len ? seg->addr + seg->len : win + len;
+
+        if (start >= end)
+            continue;
+
+        for (; k < samples; k++) {
+            uint32_t pos = (uint64_t)k * total / samples;
+            uint32_t addr, n;
+
+            if (pos >= seen + end - start)
+                break;
+            addr = start + pos - seen;
+            n = end - addr < ICP_SAMPLE_LEN ? end - addr : ICP_SAMPLE_LEN;
+
+            icp_aprom_byte_read(base + addr - win, n, buf);
+            if (memcmp(buf, &seg->data[addr - seg->addr], n)) {
+                perf_end();
+                return -1;
+            }
+        }
+        seen += end - start;
+    }
+
+    perf_end();
+    return 0;
+}
+
+/* CONFIG must be blank, see icp_cfg_erase() */
+uint32_t icp_cfg_byte_write(uint8_t *data)
+{
+    perf_begin(PERF_CONFIG);
+    log_debug("icp_cfg_byte_write()\n");
+    icp_byte_write(CMD_APROM_BYTE_WRITE, CFG_FLASH_ADDR, CFG_FLASH_LEN, data);
+    perf_end();
+    return 0;
+}
+
+/* CONFIG is a flash page of its own, with the page erase timing */
+uint32_t icp_cfg_erase(void)
+{
+    perf_begin(PERF_CONFIG);
+    log_debug("icp_cfg_erase()\n");
+
+    icp_send_command(CMD_APROM_PAGE_ERASE, CFG_FLASH_ADDR);
+    icp_write_byte(0xff, 1, icp_dev->page_erase_delay1_us, icp_dev->page_erase_delay2_us);
+
+    perf_end();
+    return 0;
+}
+
+void icp_read_config(uint8_t *cfg)
+{
+    icp_aprom_byte_read(CFG_FLASH_ADDR, CFG_FLASH_LEN, cfg);
+}
+
+/*
+ * CONFIG0 bit 7 clear boots from LDROM. CONFIG1 LDSIZE[2:0] counts LDROM
+ * steps down from 7, every value below 7 - ldrom_max / ldrom_step gives
+ * the largest LDROM. The LDROM sits at the top, APROM gets the rest.
+ */
+void icp_decode_config(const uint8_t *cfg, struct icp_layout *layout)
+{
+    uint32_t ldrom_size = (7 - (cfg[1] & 0x7)) * icp_dev->ldrom_step;
+
+    if (ldrom_size > icp_dev->ldrom_max)
+        ldrom_size = icp_dev->ldrom_max;
+
+    layout->ldrom_size = ldrom_size;
+    layout->aprom_size = icp_dev->flash_size - ldrom_size;
+    layout->boot_ldrom = !(cfg[0] & 0x80);
+}
+
+void icp_print_config(const uint8_t *cfg)
+{
+    struct icp_layout layout;
+
+    icp_decode_config(cfg, &layout);
+
+    log_info("CFGs: 0x%01x 0x%01x 0x%01x 0x%01x 0x%01x\n",
+             cfg[0], cfg[1], cfg[2], cfg[3], cfg[4]);
+    log_info("Boot from %s, APROM %u bytes, LDROM %u bytes\n",
+             layout.boot_ldrom ? "LDROM" : "APROM", layout.aprom_size, layout.ldrom_size);
+}
+
+void icp_mass_erase(void)
+{
+	perf_begin(PERF_ERASE);
+	log_debug("icp_mass_erase()\n");
+	icp_send_command(CMD_MASS_ERASE, 0x3A5A5);
+	icp_write_byte(0xff, 1, icp_dev->mass_erase_delay1_us, icp_dev->mass_erase_delay2_us);
+	perf_end();
+}
+
+void icp_aprom_page_erase(uint32_t addr)
+{
+	perf_begin(PERF_ERASE);
+	log_debug("icp_aprom_page_erase()\n");
+	icp_send_command(CMD_APROM_PAGE_ERASE, addr);
+	icp_write_byte(0xff, 1, icp_dev->page_erase_delay1_us, icp_dev->page_erase_delay2_us);
+	perf_end();
+}
+
+/*
+ * Bring the flash range [addr, addr + len) to the contents of data, but
+ * only erase and program the pages that differ from what is already in
+ * the chip. Only the reprogrammed pages are verified, each right after
+ * it was written with page_verify, and retried if they do not match.
+ * Returns the number of reprogrammed pages or -1 if verification failed.
+ */
+int icp_diff_program(uint32_t addr, uint32_t len, uint8_t *data, int page_verify)
+{
+	uint8_t cur[ICP_MAX_FLASH_SIZE], changed_map[ICP_MAX_FLASH_SIZE / ICP_MIN_PAGE_SIZE];
+	uint32_t page = icp_dev->page_size;
+	uint32_t written = 0, programmed = 0;
+	int pages = 0, changed = 0;
+	/* data as an image, for the page retries */
+	struct image_seg seg = { .addr = 0, .len = len, .cap = len, .data = data };
+	struct image img = { .segs = &seg, .num_segs = 1, .max_segs = 1 };
+
+	log_debug("icp_diff_program()\n");
+	icp_aprom_byte_read(addr, len, cur);
+
+	for (uint32_t off = 0; off < len; off += page) {
+		uint32_t n = len - off < page ? len - off : page;
+
+		changed_map[pages] = !!memcmp(&cur[off], &data[off], n);
+		pages++;
+		if (!changed_map[pages - 1])
+			continue;
+
+		icp_aprom_page_erase(addr + off);
+		written += icp_byte_write_skip_blank(icp_aprom_byte_write, addr + off, n, &data[off]);
+		programmed += n;
+		changed++;
+
+		if (page_verify && icp_settle_page(&img, off, n, addr + off, &written) < 0)
+			return -1;
+	}
+
+	icp_print_blank_summary(programmed, written);
+	log_info("Reprogrammed %d of %d pages\n", changed, pages);
+
+	for (int p = 0; p < pages && !page_verify; p++) {
+		uint32_t off = p * page;
+		uint32_t n = len - off < page ? len - off : page;
+
+		if (changed_map[p] && icp_settle_page(&img, off, n, addr + off, &written) < 0)
+			return -1;
+	}
+
+	return changed;
+}
+
+/* CONFIG for an LDROM of ldrom_size bytes at the top, booting from it */
+void icp_ldrom_config(uint32_t ldrom_size, uint8_t *cfg)
+{
+    uint8_t ldrom_sz_cfg = (7 - ldrom_size / icp_dev->ldrom_step) & 0x7;
+
+    log_debug("ldrom_sz_cfg: 0x%01x\n", ldrom_sz_cfg);
+    cfg[0] &= 0x7f;
+    cfg[1] = (cfg[1] & ~0x7) | ldrom_sz_cfg;
+}
+
+/*
+ * Turn cfg, CONFIG before a run, into the one the run programs: the one
+ * aprom carries, if any, with the size of and boot from an LDROM of
+ * ldrom_size bytes unless that is 0. Session and cache share it.
+ */
+void icp_image_config(const struct image *aprom, uint32_t ldrom_size, uint8_t *cfg)
+{
+    if (aprom && image_bytes(aprom, CFG_FLASH_ADDR, CFG_FLASH_LEN))
+        image_flatten(aprom, CFG_FLASH_ADDR, CFG_FLASH_LEN, cfg);
+    if (ldrom_size)
+        icp_ldrom_config(ldrom_size, cfg);
+}
+
+/*
+ * The LDROM size the LDROM_IMAGE_ADDR window of img needs, in whole LDROM
+ * steps of the device. Returns <0 if there is no LDROM data.
+ */
+int icp_ldrom_size(const struct image *img)
+{
+    uint8_t data[LDROM_MAX_SIZE];
+    uint32_t len = image_flatten(img, LDROM_IMAGE_ADDR, icp_dev->ldrom_max, data);
+
+    if (!len) {
+        log_err("No LDROM data in image\n");
+        return -1;
+    }
+    if (image_bytes(img, LDROM_IMAGE_ADDR + icp_dev->ldrom_max, LDROM_MAX_SIZE))
+        log_info("LDROM image is larger than the %u bytes of the %s, truncated\n",
+                 icp_dev->ldrom_max, icp_dev->name);
+
+    log_debug("ldrom_program_size: 0x%04x\n", len);
+    return ((len - 1) / icp_dev->ldrom_step + 1) * icp_dev->ldrom_step;
+}
+
+/*
+ * Put the LDROM_IMAGE_ADDR window of img at the top of flash as an LDROM
+ * of ldrom_size bytes, into erased flash or, in diff_mode, only the pages
+ * that differ. CONFIG is up to the caller. Returns <0 if verification
+ * failed.
+ */
+int icp_program_ldrom(const struct image *img, uint32_t ldrom_size, int diff_mode, int page_verify)
+{
+    uint32_t base = icp_dev->flash_size - ldrom_size;
+    int ret;
+
+    if (diff_mode) {
+        uint8_t data[LDROM_MAX_SIZE];
+
+        /* program and verify changed LDROM pages */
+        image_flatten(img, LDROM_IMAGE_ADDR, ldrom_size, data);
+        ret = icp_diff_program(base, ldrom_size, data, page_verify);
+    } else {
+        /* program and verify LDROM */
+        ret = icp_program_image(img, LDROM_IMAGE_ADDR, ldrom_size, base, page_verify);
+    }
+    log_info("Programmed LDROM (%u bytes)\n", image_bytes(img, LDROM_IMAGE_ADDR, ldrom_size));
+
+    return ret;
+}
+
+/*
+ * The APROM size next to an LDROM of ldrom_size bytes. Image data past
+ * the APROM is reported, it cannot be programmed.
+ */
+uint32_t icp_aprom_size(const struct image *img, uint32_t ldrom_size)
+{
+    uint32_t aprom_size = icp_dev->flash_size - ldrom_size;
+    uint32_t lost = image_bytes(img, aprom_size, LDROM_IMAGE_ADDR - aprom_size);
+
+    if (lost)
+        log_info("%u bytes of the image are past the %u byte APROM, not programmed\n",
+                 lost, aprom_size);
+
+    return aprom_size;
+}
+
+/*
+ * Program the APROM part of img, aprom_size bytes from address 0, into
+ * erased flash or, in diff_mode, only the pages that differ. Gaps in the
+ * image count as 0xff for the page diff. CONFIG is up to the caller.
+ * Returns <0 if verification failed.
+ */
+int icp_program_aprom(const struct image *img, int aprom_size, int diff_mode, int page_verify)
+{
+    uint32_t len = image_bytes(img, APROM_FLASH_ADDR, aprom_size);
+    int ret;
+
+    if (diff_mode) {
+        uint8_t data[ICP_MAX_FLASH_SIZE];
+
+        /* program and verify changed APROM pages, LDROM is left alone */
+        image_flatten(img, APROM_FLASH_ADDR, aprom_size, data);
+        ret = icp_diff_program(APROM_FLASH_ADDR, aprom_size, data, page_verify);
+    } else {
+        /* program and verify the populated parts of APROM */
+        ret = icp_program_image(img, APROM_FLASH_ADDR, aprom_size, APROM_FLASH_ADDR, page_verify);
+    }
+    log_info("Programmed APROM (%u bytes)\n", len);
+
+    return ret;
+}
@@ -0,0 +1,150 @@
+/*
+ * nuvoicp - ICP protocol for the Nuvoton N76E003/MS51
+ *
+ * Copyright (c) 2021 Steve Markgraf <steve@steve-m.de>
+ *
+ * Distributed under the same terms as nuvoicp.c, see there.
+ */
+
+#ifndef ICP_H
+#define ICP_H
+
+#include <stdint.h>
+
+#include "pgm.h"
+#include "wave.h"
+
+struct image;
+
+#define NUVOTON_ID           0xda
+#define N76E003_DEVID        0x3650
+#define MS51FB9AE_DEVID      0x4b21
+
+/* bounds over all devices in the table, for buffers */
+#define ICP_MAX_FLASH_SIZE   (18 * 1024)
+#define ICP_MIN_PAGE_SIZE    128
+#define LDROM_MAX_SIZE       (4 * 1024)
+
+/* 0xff runs this long are skipped, a new write command costs about two bytes */
+#define BLANK_RUN_MIN        2
+
+#define APROM_FLASH_ADDR     0x0
+#define LDROM_FLASH_ADDR     0x0
+#define CFG_FLASH_ADDR       0x30000
+#define CFG_FLASH_LEN        5
+
+/* where HEX/SREC images and raw -l binaries carry LDROM, offset 0 is its start */
+#define LDROM_IMAGE_ADDR     0x20000
+
+/*
+ * A frame is the address shifted above a 6 bit command. LDROM at the top
+ * of the flash and CONFIG at CFG_FLASH_ADDR take the APROM commands at
+ * their own addresses, there are no separate command codes for them.
+ * Codes above 0x3f spill into the address, e.g. 0xa2 with 0x180 is just
+ * an APROM page erase at 0x182.
+ */
+#define CMD_READ_CID         0x0b
+#define CMD_READ_DEVICE_ID   0x0c
+#define CMD_READ_UID         0x04
+#define CMD_APROM_PAGE_ERASE 0x22
+#define CMD_APROM_BYTE_WRITE 0x21
+#define CMD_APROM_BYTE_READ  0x00
+
+#define CMD_MASS_ERASE       0x26
+
+#define ICP_UID_LEN          12
+
+/* times a page that does not verify is erased and programmed again */
+#define ICP_PAGE_RETRIES     3
+
+/* bytes per sample of icp_sample_verify() */
+#define ICP_SAMPLE_LEN       8
+
+/* what differs between the supported chips, looked up by device ID */
+struct icp_device {
+    const char *name;
+    uint16_t devid;
+    uint32_t flash_size;        /* APROM and LDROM together */
+    uint32_t page_size;
+    uint32_t ldrom_step;        /* LDROM size granularity of CONFIG1 */
+    uint32_t ldrom_max;
+    /* icp_write_byte() delays for one byte, a page and a mass erase */
+    int prog_delay1_us, prog_delay2_us;
+    int page_erase_delay1_us, page_erase_delay2_us;
+    int mass_erase_delay1_us, mass_erase_delay2_us;
+};
+
+/* how CONFIG splits the flash */
+struct icp_layout {
+    uint32_t aprom_size;
+    uint32_t ldrom_size;
+    int boot_ldrom;
+};
+
+/* per context, see ctx.h */
+struct icp_state {
+    const struct icp_device *dev;	/* identified, the smallest one until then */
+    struct wave wave;
+    /* gang programming: targets still in the run and where each one failed */
+    uint32_t gang_live;
+    int32_t gang_bad_addr[PGM_MAX_TARGETS];
+};
+
+/* the identified device of the current context, needs ctx.h */
+#define icp_dev (ctx_cur->icp.dev)
+
+void icp_ctx_init(struct icp_state *is);
+
+void icp_bitsend(uint32_t data, int len);
+void icp_send_command(uint8_t cmd, uint32_t dat);
+const struct icp_device *icp_find_device(uint16_t devid);
+struct icp_device *icp_tune_device(uint16_t devid);
+void icp_init(void);
+void icp_reinit(void);
+void icp_exit(void);
+uint8_t icp_read_bits(void);
+void icp_read_end(int end);
+uint8_t icp_read_byte(int end);
+void icp_write_byte(uint8_t data, int end, int delay1, int delay2);
+
+uint32_t icp_read_device_id(void);
+uint8_t icp_read_cid(void);
+void icp_read_uid_bytes(uint8_t *uid);
+uint32_t icp_read_ucid(void);
+
+uint32_t icp_aprom_byte_read(uint32_t addr, uint32_t len, uint8_t *data);
+uint32_t icp_aprom_byte_write(uint32_t addr, uint32_t len, uint8_t *data);
+uint32_t icp_byte_write_skip_blank(uint32_t (*write)(uint32_t, uint32_t, uint8_t *),
+                                   uint32_t addr, uint32_t len, uint8_t *data);
+void icp_print_blank_summary(uint32_t len, uint32_t written);
+int icp_byte_verify(uint8_t read_cmd, uint32_t addr, uint32_t len, const uint8_t *data);
+
+void icp_gang_read_bits(uint8_t *data);
+void icp_gang_read(uint8_t cmd, uint32_t addr, uint32_t len, uint8_t data[][PGM_MAX_TARGETS]);
+uint32_t icp_gang_byte_verify(uint8_t read_cmd, uint32_t addr, uint32_t len,
+                              const uint8_t *data, uint32_t mask);
+int icp_range_verify(uint8_t read_cmd, uint32_t addr, uint32_t len, const uint8_t *data);
+uint32_t icp_gang_identify(void);
+void icp_gang_report(uint32_t found);
+
+int icp_program_image(const struct image *img, uint32_t win, uint32_t len,
+                      uint32_t base, int page_verify);
+int icp_verify_image(const struct image *img, uint32_t win, uint32_t len, uint32_t base);
+int icp_sample_verify(const struct image *img, uint32_t win, uint32_t len, uint32_t base,
+                      int samples);
+void icp_read_config(uint8_t *cfg);
+void icp_decode_config(const uint8_t *cfg, struct icp_layout *layout);
+void icp_print_config(const uint8_t *cfg);
+void icp_ldrom_config(uint32_t ldrom_size, uint8_t *cfg);
+void icp_image_config(const struct image *aprom, uint32_t ldrom_size, uint8_t *cfg);
+int icp_ldrom_size(const struct image *img);
+uint32_t icp_aprom_size(const struct image *img, uint32_t ldrom_size);
+uint32_t icp_cfg_byte_write(uint8_t *data);
+uint32_t icp_cfg_erase(void);
+void icp_mass_erase(void);
+void icp_aprom_page_erase(uint32_t addr);
+int icp_diff_program(uint32_t addr, uint32_t len, uint8_t *data, int page_verify);
+int icp_program_ldrom(const struct image *img, uint32_t ldrom_size, int diff_mode, int page_verify);
+int icp_program_aprom(const struct image *img, int aprom_size, int diff_mode, int page_verify);
+
+#endif
@@ -0,0 +1,427 @@
+/*
+ * nuvoicp - firmware image loader
+ *
+ * Loads Intel HEX, Motorola S-record and raw binary files into a sorted
+ * list of populated segments, so gaps in the linker output are never
+ * programmed. The format is taken from the first character, raw binaries
+ * become a single segment at the address the caller passes in.
+ *
+ * The text formats are parsed in one pass over the file read in a single
+ * go: hex digits go through a lookup table and records that continue the
+ * previous one are appended to its segment. Out of order records start a
+ * new segment, those are sorted and merged once at the end.
+ *
+ * Distributed under the same terms as nuvoicp.c, see there.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+#include "image.h"
+
+/* 0x00-0x0f for hex digits, 0xff for everything else */
+static uint8_t hex_val[256];
+
+struct parser {
+	const char *path;
+	const uint8_t *p, *end;
+	int line;
+	uint32_t seq;
+};
+
+static pthread_once_t hex_once = PTHREAD_ONCE_INIT;
+
+static void hex_fill(void)
+{
+	memset(hex_val, 0xff, sizeof(hex_val));
+	for (int i = 0; i < 10; i++)
+		hex_val['0' + i] = i;
+	for (int i = 0; i < 6; i++)
+		hex_val['a' + i] = hex_val['A' + i] = 10 + i;
+}
+
+/* images may be loaded from several threads */
+static void hex_init(void)
+{
+	pthread_once(&hex_once, hex_fill);
+}
+
+/* n bytes of hex digits, -1 on a bad or missing digit */
+static int parse_bytes(struct parser *ps, uint8_t *out, int n)
+{
+	if (ps->end - ps->p < 2 * n)
+		return -1;
+
+	for (int i = 0; i < n; i++) {
+		uint8_t hi = hex_val[ps->p[0]], lo = hex_val[ps->p[1]];
+
+		if ((hi | lo) & 0xf0)
+			return -1;
+		out[i] = (hi << 4) | lo;
+		ps->p += 2;
+	}
+
+	return 0;
+}
+
+static void next_line(struct parser *ps)
+{
+	while (ps->p < ps->end && *ps->p != '\n')
+		ps->p++;
+	if (ps->p < ps->end)
+		ps->p++;
+	ps->line++;
+}
+
+static int parse_error(struct parser *ps, const char *msg)
+{
+	fprintf(stderr, "%s:%d: %s\n", ps->path, ps->line, msg);
+	return -EINVAL;
+}
+
+static int image_add(struct image *img, struct parser *ps, uint32_t addr,
+		     const uint8_t *data, uint32_t len)
+{
+	struct image_seg *seg = img->num_segs ? &img->segs[img->num_segs - 1] : NULL;
+
+	if (!len)
+		return 0;
+
+	/* the common case, the record continues the last one */
+	if (!seg || seg->addr + seg->len != addr) {
+		if (img->num_segs == img->max_segs) {
+			int max = img->max_segs ? 2 * img->max_segs : 16;
+			struct image_seg *segs = realloc(img->segs, max * sizeof(*segs));
+
+			if (!segs)
+				return -ENOMEM;
+			img->segs = segs;
+			img->max_segs = max;
+		}
+		seg = &img->segs[img->num_segs++];
+		memset(seg, 0, sizeof(*seg));
+		seg->addr = addr;
+		seg->seq = ps ? ps->seq++ : 0;
+	}
+
+	if (seg->len + len > seg->cap) {
+		uint32_t cap = seg->cap ? seg->cap : 1024;
+		uint8_t *buf;
+
+		while (cap < seg->len + len)
+			cap *= 2;
+		buf = realloc(seg->data, cap);
+		if (!buf)
+			return -ENOMEM;
+		seg->data = buf;
+		seg->cap = cap;
+	}
+
+	memcpy(&seg->data[seg->len], data, len);
+	seg->len += len;
+
+	return 0;
+}
+
+static int parse_ihex(struct image *img, struct parser *ps)
+{
+	uint32_t base = 0;
+	uint8_t rec[5 + 255];
+
+	for (; ps->p < ps->end; next_line(ps)) {
+		uint8_t sum = 0;
+		uint32_t addr;
+		int len, ret;
+
+		if (*ps->p == '\r' || *ps->p == '\n')
+			continue;
+		if (*ps->p++ != ':')
+			return parse_error(ps, "record does not start with ':'");
+
+		/* count, address, type, data and checksum */
+		if (parse_bytes(ps, rec, 1) < 0 || parse_bytes(ps, rec + 1, rec[0] + 4) < 0)
+			return parse_error(ps, "bad record");
+		len = rec[0];
+		for (int i = 0; i < len + 5; i++)
+			sum += rec[i];
+		if (sum)
+			return parse_error(ps, "bad checksum");
+
+		addr = base + ((rec[1] << 8) | rec[2]);
+
+		switch (rec[3]) {
+		case 0x00:
+			ret = image_add(img, ps, addr, &rec[4], len);
+			if (ret < 0)
+				return ret;
+			break;
+		case 0x01:
+			return 0;
+		case 0x02:
+			base = ((rec[4] << 8) | rec[5]) << 4;
+			break;
+		case 0x04:
+			base = ((rec[4] << 8) | rec[5]) << 16;
+			break;
+		default:
+			/* start addresses */
+			break;
+		}
+	}
+
+	return 0;
+}
+
+static int parse_srec(struct image *img, struct parser *ps)
+{
+	uint8_t rec[1 + 255];
+
+	for (; ps->p < ps->end; next_line(ps)) {
+		uint8_t sum = 0;
+		uint32_t addr = 0;
+		int type, alen, ret;
+
+		if (*ps->p == '\r' || *ps->p == '\n')
+			continue;
+		if (ps->end - ps->p < 2 || ps->p[0] != 'S')
+			return parse_error(ps, "record does not start with 'S'");
+		type = ps->p[1] - '0';
+		ps->p += 2;
+
+		if (parse_bytes(ps, rec, 1) < 0 || !rec[0] || parse_bytes(ps, rec + 1, rec[0]) < 0)
+			return parse_error(ps, "bad record");
+		for (int i = 0; i <= rec[0]; i++)
+			sum += rec[i];
+		if (sum != 0xff)
+			return parse_error(ps, "bad checksum");
+
+		switch (type) {
+		case 1:
+		case 2:
+		case 3:
+			alen = type + 1;
+			if (rec[0] < alen + 1)
+				return parse_error(ps, "bad record");
+			for (int i = 0; i < alen; i++)
+				addr = (addr << 8) | rec[1 + i];
+			ret = image_add(img, ps, addr, &rec[1 + alen], rec[0] - alen - 1);
+			if (ret < 0)
+				return ret;
+			break;
+		case 7:
+		case 8:
+		case 9:
+			return 0;
+		default:
+			/* header and record counts */
+			break;
+		}
+	}
+
+	return 0;
+}
+
+static int seg_cmp_addr(const void *a, const void *b)
+{
+	const struct image_seg *sa = a, *sb = b;
+
+	if (sa->addr != sb->addr)
+		return sa->addr < sb->addr ? -1 : 1;
+	return sa->seq < sb->seq ? -1 : 1;
+}
+
+static int seg_cmp_seq(const void *a, const void *b)
+{
+	const struct image_seg *sa = a, *sb = b;
+
+	return sa->seq < sb->seq ? -1 : sa->seq > sb->seq;
+}
+
+/* sort the segments and merge the ones that touch or overlap */
+static int image_merge(struct image *img)
+{
+	int out = 0;
+
+	qsort(img->segs, img->num_segs, sizeof(*img->segs), seg_cmp_addr);
+
+	for (int i = 0, j; i < img->num_segs; i = j) {
+		uint32_t start = img->segs[i].addr;
+		uint32_t end = start + img->segs[i].len;
+		uint8_t *buf;
+
+		for (j = i + 1; j < img->num_segs && img->segs[j].addr <= end; j++) {
+			if (img->segs[j].addr + img->segs[j].len > end)
+				end = img->segs[j].addr + img->segs[j].len;
+		}
+
+		if (j == i + 1) {
+			img->segs[out++] = img->segs[i];
+			continue;
+		}
+
+		buf = malloc(end - start);
+		if (!buf)
+			return -ENOMEM;
+
+		/* where records overlap the later one in the file wins */
+		qsort(&img->segs[i], j - i, sizeof(*img->segs), seg_cmp_seq);
+		for (int k = i; k < j; k++) {
+			memcpy(&buf[img->segs[k].addr - start], img->segs[k].data, img->segs[k].len);
+			free(img->segs[k].data);
+		}
+
+		img->segs[out++] = (struct image_seg) {
+			.addr = start, .len = end - start, .cap = end - start, .data = buf,
+		};
+	}
+
+	img->num_segs = out;
+
+	return 0;
+}
+
+/*
+ * Load path into img, which must be zeroed or freed. Returns 0 on
+ * success and a negative error code otherwise.
+ */
+int image_load(struct image *img, const char *path, uint32_t raw_addr)
+{
+	struct parser ps = { .path = path, .line = 1 };
+	uint8_t *buf = NULL;
+	struct stat st;
+	FILE *f;
+	int ret;
+
+	hex_init();
+	memset(img, 0, sizeof(*img));
+
+	f = fopen(path, "rb");
+	if (!f) {
+		fprintf(stderr, "Opening %s failed: %s\n", path, strerror(errno));
+		return -ENOENT;
+	}
+
+	if (fstat(fileno(f), &st) < 0 || !(buf = malloc(st.st_size + 1)) ||
+	    fread(buf, 1, st.st_size, f) != st.st_size) {
+		fprintf(stderr, "Reading %s failed\n", path);
+		free(buf);
+		fclose(f);
+		return -EIO;
+	}
+	fclose(f);
+
+	ps.p = buf;
+	ps.end = buf + st.st_size;
+
+	if (st.st_size && buf[0] == ':')
+		ret = parse_ihex(img, &ps);
+	else if (st.st_size > 1 && buf[0] == 'S' && hex_val[buf[1]] < 10)
+		ret = parse_srec(img, &ps);
+	else
+		ret = image_add(img, NULL, raw_addr, buf, st.st_size);
+
+	free(buf);
+
+	if (!ret)
+		ret = image_merge(img);
+	if (ret < 0)
+		image_free(img);
+
+	return ret;
+}
+
+/*
+ * Make img, which must be zeroed or freed, a copy of the len bytes at
+ * data, placed at addr. For images that are in memory already.
+ */
+int image_from_buf(struct image *img, const uint8_t *data, uint32_t len, uint32_t addr)
+{
+	int ret;
+
+	memset(img, 0, sizeof(*img));
+	ret = image_add(img, NULL, addr, data, len);
+	if (ret < 0)
+		image_free(img);
+
+	return ret;
+}
+
+void image_free(struct image *img)
+{
+	for (int i = 0; i < img->num_segs; i++)
+		free(img->segs[i].data);
+	free(img->segs);
+	memset(img, 0, sizeof(*img));
+}
+
+/* number of populated bytes in [addr, addr + len) */
+uint32_t image_bytes(const struct image *img, uint32_t addr, uint32_t len)
+{
+	uint32_t n = 0;
+
+	for (int i = 0; i < img->num_segs; i++) {
+		const struct image_seg *seg = &img->segs[i];
+		uint32_t start = seg->addr > addr ? seg->addr : addr;
+		uint32_t end = seg->addr + seg->len < addr + len ? seg->addr + seg->len : addr + len;
+
+		if (start < end)
+			n += end - start;
+	}
+
+	return n;
+}
+
+/*
+ * Copy [addr, addr + len) of the image into buf, gaps are filled with
+ * 0xff. Returns the offset just past the last populated byte, 0 if the
+ * range is empty.
+ */
+uint32_t image_flatten(const struct image *img, uint32_t addr, uint32_t len, uint8_t *buf)
+{
+	uint32_t top = 0;
+
+	memset(buf, 0xff, len);
+
+	for (int i = 0; i < img->num_segs; i++) {
+		const struct image_seg *seg = &img->segs[i];
+		uint32_t start = seg->addr > addr ? seg->addr : addr;
+		uint32_t end = seg->addr + seg->len < addr + len ? seg->addr + seg->len : addr + len;
+
+		if (start >= end)
+			continue;
+		memcpy(&buf[start - addr], &seg->data[start - seg->addr], end - start);
+		top = end - addr;
+	}
+
+	return top;
+}
+
+static uint64_t hash_bytes(uint64_t hash, const uint8_t *p, uint32_t len)
+{
+	for (uint32_t i = 0; i < len; i++)
+		hash = (hash ^ p[i]) * 0x100000001b3ULL;
+
+	return hash;
+}
+
+/* hash of the populated bytes and where they are, gaps do not count */
+uint64_t image_hash(const struct image *img, uint64_t hash)
+{
+	for (int i = 0; i < img->num_segs; i++) {
+		const struct image_seg *seg = &img->segs[i];
+		uint8_t hdr[8] = {
+			seg->addr, seg->addr >> 8, seg->addr >> 16, seg->addr >> 24,
+			seg->len, seg->len >> 8, seg->len >> 16, seg->len >> 24,
+		};
+
+		hash = hash_bytes(hash, hdr, sizeof(hdr));
+		hash = hash_bytes(hash, seg->data, seg->len);
+	}
+
+	return hash;
+}
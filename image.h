@@ -0,0 +1,37 @@
+/*
+ * nuvoicp - firmware image loader
+ *
+ * Distributed under the same terms as nuvoicp.c, see there.
+ */
+
+#ifndef IMAGE_H
+#define IMAGE_H
+
+#include <stdint.h>
+
+/* a run of populated bytes, segments are sorted and never touch */
+struct image_seg {
+	uint32_t addr;
+	uint32_t len;
+	uint32_t cap;
+	uint32_t seq;		/* order in the file, later records win */
+	uint8_t *data;
+};
+
+struct image {
+	struct image_seg *segs;
+	int num_segs;
+	int max_segs;
+};
+
+/* FNV-1a, chain several images by passing the previous result */
+#define IMAGE_HASH_INIT	0xcbf29ce484222325ULL
+
+int image_load(struct image *img, const char *path, uint32_t raw_addr);
+int image_from_buf(struct image *img, const uint8_t *data, uint32_t len, uint32_t addr);
+void image_free(struct image *img);
+uint32_t image_bytes(const struct image *img, uint32_t addr, uint32_t len);
+uint32_t image_flatten(const struct image *img, uint32_t addr, uint32_t len, uint8_t *buf);
+uint64_t image_hash(const struct image *img, uint64_t hash);
+
+#endif
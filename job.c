@@ -0,0 +1,268 @@
+/*
+ * nuvoicp - jobs on a target, for the daemon and the scheduler
+ *
+ * A request is a job name and its arguments, as the daemon takes them:
+ *
+ *   identify
+ *   program <file> [ldrom=<file>] [diff] [pageverify]
+ *   verify <file>
+ *   read <file>
+ *   erase
+ *   load <file>
+ *   quit
+ *
+ * Parsing gets the images from the caller, which keeps them. Running a
+ * job that needs the target resets it into ICP mode and identifies it
+ * first, so units can be swapped between jobs, and leaves releasing it
+ * to the caller. The reply carries the IDs of the target and the result,
+ * or only the error if the job failed.
+ *
+ * Distributed under the same terms as nuvoicp.c, see there.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdarg.h>
+#include <string.h>
+
+#include "job.h"
+#include "session.h"
+#include "icp.h"
+#include "cache.h"
+#include "image.h"
+#include "ctx.h"
+
+static const char *const job_names[] = {
+	[JOB_NONE]	= "",
+	[JOB_IDENTIFY]	= "identify",
+	[JOB_PROGRAM]	= "program",
+	[JOB_VERIFY]	= "verify",
+	[JOB_READ]	= "read",
+	[JOB_ERASE]	= "erase",
+	[JOB_LOAD]	= "load",
+	[JOB_QUIT]	= "quit",
+};
+
+void reply_add(struct reply *r, const char *fmt, ...)
+{
+	va_list ap;
+	int n;
+
+	va_start(ap, fmt);
+	n = vsnprintf(r->buf + r->len, sizeof(r->buf) - r->len, fmt, ap);
+	va_end(ap);
+
+	if (n > 0)
+		r->len += n;
+	if (r->len >= sizeof(r->buf))
+		r->len = sizeof(r->buf) - 1;
+}
+
+void reply_start(struct reply *r, const struct job *job)
+{
+	r->len = 0;
+	reply_add(r, "{\"status\":\"ok\",\"job\":\"%s\"%s", job_names[job->type], r->tag);
+}
+
+/* error replies replace whatever the job had collected so far */
+int reply_error(struct reply *r, const struct job *job, const char *msg)
+{
+	r->len = 0;
+	reply_add(r, "{\"status\":\"error\",\"job\":\"%s\"%s,\"error\":\"%s\"",
+		  job_names[job->type], r->tag, msg);
+
+	return -1;
+}
+
+void reply_end(struct reply *r, uint64_t ns)
+{
+	reply_add(r, ",\"ms\":%llu}\n", (unsigned long long)ns / 1000000);
+}
+
+static const char *job_parse_program(struct job *job, char **args, int nargs, job_image_fn get)
+{
+	for (int i = 0; i < nargs; i++) {
+		if (!strcmp(args[i], "diff"))
+			job->diff_mode = 1;
+		else if (!strcmp(args[i], "pageverify"))
+			job->page_verify = 1;
+		else if (!strncmp(args[i], "ldrom=", 6) && !(job->ldrom = get(args[i] + 6, LDROM_IMAGE_ADDR)))
+			return "cannot load LDROM image";
+		else if (!strchr(args[i], '=') && !(job->aprom = get(args[i], APROM_FLASH_ADDR)))
+			return "cannot load image";
+	}
+
+	if (!job->aprom)
+		return "no image given";
+
+	/* a HEX/SREC image may carry LDROM as well */
+	if (!job->ldrom && image_bytes(job->aprom, LDROM_IMAGE_ADDR, LDROM_MAX_SIZE))
+		job->ldrom = job->aprom;
+	if (job->ldrom && !image_bytes(job->ldrom, LDROM_IMAGE_ADDR, LDROM_MAX_SIZE))
+		return "no LDROM data in image";
+
+	return NULL;
+}
+
+/*
+ * Parse the request args[0..nargs), loading its images through get.
+ * Returns NULL or the error, with job->type set if the job is known.
+ */
+const char *job_parse(struct job *job, char **args, int nargs, job_image_fn get)
+{
+	memset(job, 0, sizeof(*job));
+
+	if (!nargs)
+		return "empty request";
+
+	for (int t = JOB_IDENTIFY; t <= JOB_QUIT; t++) {
+		if (!strcmp(args[0], job_names[t]))
+			job->type = t;
+	}
+
+	switch (job->type) {
+	case JOB_NONE:
+		return "unknown job";
+	case JOB_PROGRAM:
+		return job_parse_program(job, args + 1, nargs - 1, get);
+	case JOB_VERIFY:
+	case JOB_LOAD:
+		if (nargs != 2)
+			return job->type == JOB_VERIFY ? "usage: verify <file>" : "usage: load <file>";
+		job->aprom = get(args[1], APROM_FLASH_ADDR);
+		return job->aprom ? NULL : "cannot load image";
+	case JOB_READ:
+		if (nargs != 2)
+			return "usage: read <file>";
+		job->path = args[1];
+		return NULL;
+	default:
+		return NULL;
+	}
+}
+
+int job_uses_target(const struct job *job)
+{
+	return job->type >= JOB_IDENTIFY && job->type <= JOB_ERASE;
+}
+
+/*
+ * Reset the target into ICP mode and identify it. The short reset is
+ * enough for a target that was in ICP mode before, a freshly plugged one
+ * may need the full entry sequence.
+ */
+static int job_enter(struct icp_session *s, const struct job *job, struct reply *r)
+{
+	if (session_reenter(s) < 0)
+		return reply_error(r, job, "no target");
+	if (session_identify(s) < 0)
+		return reply_error(r, job, "unknown device ID");
+
+	reply_add(r, ",\"cid\":\"0x%02x\",\"devid\":\"0x%04x\",\"device\":\"%s\",\"uid\":\"",
+		  s->cid, s->devid, s->dev->name);
+	for (int i = 0; i < ICP_UID_LEN; i++)
+		reply_add(r, "%02x", s->uid[i]);
+	reply_add(r, "\"");
+
+	return 0;
+}
+
+static int job_program(struct icp_session *s, const struct job *job, struct reply *r)
+{
+	struct icp_plan plan = {
+		.aprom = job->aprom,
+		.ldrom = job->ldrom,
+		.diff_mode = job->diff_mode,
+		.page_verify = job->page_verify,
+	};
+	uint64_t cache_key = cache_hash(job->aprom, job->ldrom);
+
+	if (cache_enabled() && cache_check(s->uid, cache_key, job->aprom, job->ldrom)) {
+		reply_add(r, ",\"cached\":true");
+		return 0;
+	}
+
+	session_program(s, &plan);
+
+	if (plan.ldrom_ret < 0)
+		return reply_error(r, job, "LDROM verify failed");
+	if (plan.cfg_ret < 0)
+		return reply_error(r, job, "CONFIG verify failed");
+	if (job->ldrom)
+		reply_add(r, ",\"ldrom_bytes\":%u",
+			  image_bytes(job->ldrom, LDROM_IMAGE_ADDR, LDROM_MAX_SIZE));
+	if (plan.aprom_ret < 0)
+		return reply_error(r, job, "APROM verify failed");
+	reply_add(r, ",\"aprom_bytes\":%u",
+		  image_bytes(job->aprom, APROM_FLASH_ADDR, plan.aprom_size));
+
+	if (cache_enabled())
+		cache_store(s->uid, cache_key);
+
+	return 0;
+}
+
+static int job_verify(struct icp_session *s, const struct job *job, struct reply *r)
+{
+	struct icp_layout layout;
+
+	/* only the APROM the chip is configured for */
+	icp_decode_config(session_config(s), &layout);
+
+	if (icp_verify_image(job->aprom, APROM_FLASH_ADDR, layout.aprom_size, APROM_FLASH_ADDR) < 0)
+		return reply_error(r, job, "mismatch");
+	reply_add(r, ",\"aprom_bytes\":%u",
+		  image_bytes(job->aprom, APROM_FLASH_ADDR, layout.aprom_size));
+
+	return 0;
+}
+
+static int job_read(const struct job *job, struct reply *r)
+{
+	uint8_t data[ICP_MAX_FLASH_SIZE];
+	FILE *f;
+
+	icp_aprom_byte_read(APROM_FLASH_ADDR, icp_dev->flash_size, data);
+
+	f = fopen(job->path, "wb");
+	if (!f || fwrite(data, 1, icp_dev->flash_size, f) != icp_dev->flash_size) {
+		if (f)
+			fclose(f);
+		return reply_error(r, job, "cannot write file");
+	}
+	fclose(f);
+	reply_add(r, ",\"bytes\":%u", icp_dev->flash_size);
+
+	return 0;
+}
+
+/* run a parsed job, the reply started with reply_start(), <0 if it failed */
+int job_run(struct icp_session *s, const struct job *job, struct reply *r)
+{
+	struct icp_plan erase = { .erase = 1 };
+
+	if (job->type == JOB_LOAD) {
+		reply_add(r, ",\"segments\":%d,\"bytes\":%u", job->aprom->num_segs,
+			  image_bytes(job->aprom, 0, UINT32_MAX));
+		return 0;
+	}
+	if (!job_uses_target(job))
+		return 0;
+
+	if (job_enter(s, job, r) < 0)
+		return -1;
+
+	switch (job->type) {
+	case JOB_PROGRAM:
+		return job_program(s, job, r);
+	case JOB_VERIFY:
+		return job_verify(s, job, r);
+	case JOB_READ:
+		return job_read(job, r);
+	case JOB_ERASE:
+		return session_program(s, &erase);
+	default:
+		return 0;
+	}
+}
@@ -0,0 +1,59 @@
+/*
+ * nuvoicp - jobs on a target, for the daemon and the scheduler
+ *
+ * Distributed under the same terms as nuvoicp.c, see there.
+ */
+
+#ifndef JOB_H
+#define JOB_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define JOB_MAX_ARGS	8
+#define JOB_MAX_REPLY	1024
+#define JOB_MAX_TAG	64
+
+struct image;
+struct icp_session;
+
+enum job_type {
+	JOB_NONE,
+	JOB_IDENTIFY,
+	JOB_PROGRAM,
+	JOB_VERIFY,
+	JOB_READ,
+	JOB_ERASE,
+	JOB_LOAD,
+	JOB_QUIT,
+};
+
+struct job {
+	enum job_type type;
+	const struct image *aprom;	/* program, verify and load */
+	const struct image *ldrom;
+	int diff_mode;
+	int page_verify;
+	const char *path;		/* read, points into the arguments */
+};
+
+/* one line with a JSON object */
+struct reply {
+	char buf[JOB_MAX_REPLY];
+	size_t len;
+	char tag[JOB_MAX_TAG];		/* fields of the caller after "job" */
+};
+
+/* the image for path, raw binaries placed at raw_addr, NULL on errors */
+typedef const struct image *(*job_image_fn)(const char *path, uint32_t raw_addr);
+
+void reply_add(struct reply *r, const char *fmt, ...) __attribute__((format(printf, 2, 3)));
+void reply_start(struct reply *r, const struct job *job);
+int reply_error(struct reply *r, const struct job *job, const char *msg);
+void reply_end(struct reply *r, uint64_t ns);
+
+const char *job_parse(struct job *job, char **args, int nargs, job_image_fn get);
+int job_uses_target(const struct job *job);
+int job_run(struct icp_session *s, const struct job *job, struct reply *r);
+
+#endif
@@ -0,0 +1,131 @@
+/*
+ * nuvoicp - resumable programming journal
+ *
+ * Lists the flash pages a run has programmed so far, under the UID of
+ * the unit and the hash of the images. A run that is cut short leaves
+ * the journal behind. When the same images go to the same unit again,
+ * the run resumes: there is no mass erase, pages already listed are only
+ * verified and the others are page erased and programmed. The journal is
+ * removed once a run has verified everything.
+ *
+ * The header goes in with the first page, so only after the mass erase.
+ * A run cut short before that leaves no header and the next one starts
+ * over, erase included.
+ *
+ * Distributed under the same terms as nuvoicp.c, see there.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+
+#include "journal.h"
+#include "icp.h"
+#include "log.h"
+#include "ctx.h"
+
+/* pages beyond the flash, like CONFIG, are never journaled */
+static int page_index(uint32_t addr)
+{
+	return addr < ICP_MAX_FLASH_SIZE ? addr / ICP_MIN_PAGE_SIZE : -1;
+}
+
+/*
+ * Open the journal at path for the unit and images. Returns 1 when a
+ * journal of an earlier run with the same ones was found and the run
+ * resumes, 0 when it starts from scratch and <0 on errors.
+ */
+int journal_open(const char *path, const uint8_t *uid, uint64_t hash)
+{
+	struct journal_state *j = &ctx_cur->journal;
+	char line[JOURNAL_LINE_MAX];
+	int pages = 0, n = 0;
+	FILE *f;
+
+	j->path = path;
+	j->resuming = 0;
+	memset(j->done, 0, sizeof(j->done));
+
+	for (int i = 0; i < ICP_UID_LEN; i++)
+		n += sprintf(&j->header[n], "%02x", uid[i]);
+	sprintf(&j->header[n], " %016llx\n", (unsigned long long)hash);
+
+	f = fopen(path, "r");
+	if (f && fgets(line, sizeof(line), f) && !strcmp(line, j->header)) {
+		unsigned int addr;
+
+		j->resuming = 1;
+		while (fgets(line, sizeof(line), f)) {
+			if (sscanf(line, "page 0x%x", &addr) == 1 && page_index(addr) >= 0) {
+				j->done[page_index(addr)] = 1;
+				pages++;
+			}
+		}
+	}
+	if (f)
+		fclose(f);
+
+	j->f = fopen(path, j->resuming ? "a" : "w");
+	if (!j->f) {
+		log_err("Opening %s failed: %s\n", path, strerror(errno));
+		j->resuming = 0;
+		return -EIO;
+	}
+
+	if (j->resuming) {
+		log_info("Resuming the run in %s, %d pages already programmed\n", path, pages);
+		j->header[0] = '\0';
+	}
+
+	return j->resuming;
+}
+
+int journal_resuming(void)
+{
+	return ctx_cur->journal.resuming;
+}
+
+int journal_page_done(uint32_t addr)
+{
+	return page_index(addr) >= 0 && ctx_cur->journal.done[page_index(addr)];
+}
+
+/*
+ * Synced right away, the run may be cut short any moment, power loss
+ * included. A page programmed but not yet on disk is only done again.
+ */
+void journal_page_add(uint32_t addr)
+{
+	struct journal_state *j = &ctx_cur->journal;
+
+	if (!j->f || page_index(addr) < 0 || j->done[page_index(addr)])
+		return;
+
+	j->done[page_index(addr)] = 1;
+	if (j->header[0]) {
+		fputs(j->header, j->f);
+		j->header[0] = '\0';
+	}
+	fprintf(j->f, "page 0x%05x\n", addr);
+	if (fflush(j->f) || fdatasync(fileno(j->f)))
+		log_err("Writing %s failed: %s\n", j->path, strerror(errno));
+}
+
+/* a complete run leaves no journal, anything else can be resumed */
+void journal_close(int complete)
+{
+	struct journal_state *j = &ctx_cur->journal;
+
+	if (!j->f)
+		return;
+
+	fclose(j->f);
+	j->f = NULL;
+	j->resuming = 0;
+
+	if (complete && unlink(j->path) < 0)
+		log_err("Removing %s failed: %s\n", j->path, strerror(errno));
+}
@@ -0,0 +1,32 @@
+/*
+ * nuvoicp - resumable programming journal
+ *
+ * Distributed under the same terms as nuvoicp.c, see there.
+ */
+
+#ifndef JOURNAL_H
+#define JOURNAL_H
+
+#include <stdio.h>
+#include <stdint.h>
+
+#include "icp.h"
+
+#define JOURNAL_LINE_MAX	64
+
+/* per context, see ctx.h */
+struct journal_state {
+	FILE *f;
+	const char *path;
+	int resuming;
+	char header[JOURNAL_LINE_MAX];	/* until the first page */
+	uint8_t done[ICP_MAX_FLASH_SIZE / ICP_MIN_PAGE_SIZE];
+};
+
+int journal_open(const char *path, const uint8_t *uid, uint64_t hash);
+int journal_resuming(void);
+int journal_page_done(uint32_t addr);
+void journal_page_add(uint32_t addr);
+void journal_close(int complete);
+
+#endif
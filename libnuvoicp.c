@@ -0,0 +1,522 @@
+/*
+ * nuvoicp - library interface
+ *
+ * A thin layer over the session: each call makes its context the current
+ * one for the duration of the call, see ctx.h, makes sure the target is
+ * identified and maps the outcome to an error code. Programming goes by
+ * the programming cache and the journal like the command line tool,
+ * which is built on these calls. A lock that is only ever tried keeps two
+ * calls off one context.
+ *
+ * Distributed under the same terms as nuvoicp.c, see there.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "libnuvoicp.h"
+#include "session.h"
+#include "icp.h"
+#include "image.h"
+#include "cache.h"
+#include "journal.h"
+#include "perf.h"
+#include "timing.h"
+#include "log.h"
+#include "pgm.h"
+#include "ctx.h"
+
+struct nuvoicp {
+	pthread_mutex_t lock;		/* held for the duration of a call */
+	struct ctx *state;		/* backend, ICP state and log of the target */
+	struct ctx *prev;		/* the caller's, back after the call */
+	char *backend;			/* pgm_select() keeps pointing into it */
+	char *journal;
+	struct icp_session session;
+	uint32_t gang_found;		/* targets of a gang that answered */
+	int reports;			/* histograms or counters to write at close */
+};
+
+static const char *const nuvoicp_errors[] = {
+	[-NUVOICP_OK]		= "success",
+	[-NUVOICP_ERR_ARG]	= "invalid argument",
+	[-NUVOICP_ERR_BUSY]	= "context in use by another call",
+	[-NUVOICP_ERR_NOMEM]	= "out of memory",
+	[-NUVOICP_ERR_BACKEND]	= "transport backend failed to open",
+	[-NUVOICP_ERR_NO_TARGET] = "no target answers",
+	[-NUVOICP_ERR_DEVICE]	= "unsupported device",
+	[-NUVOICP_ERR_RANGE]	= "outside the flash",
+	[-NUVOICP_ERR_VERIFY]	= "verification failed",
+	[-NUVOICP_ERR_CONFIG]	= "CONFIG verification failed",
+	[-NUVOICP_ERR_FILE]	= "file not readable or writable",
+};
+
+const char *nuvoicp_strerror(int err)
+{
+	if (err > 0 || -err >= sizeof(nuvoicp_errors) / sizeof(nuvoicp_errors[0]))
+		return "unknown error";
+
+	return nuvoicp_errors[-err];
+}
+
+static void nuvoicp_log_drop(int level, const char *msg, void *user)
+{
+}
+
+void nuvoicp_config_init(struct nuvoicp_config *cfg)
+{
+	memset(cfg, 0, sizeof(*cfg));
+	cfg->clk_gpio = GPIO_CLK;
+	cfg->rst_gpio = GPIO_RST;
+	cfg->dat_gpio = GPIO_DAT;
+}
+
+void nuvoicp_set_cache(const char *path)
+{
+	cache_set_path(path);
+}
+
+/* bind ctx to the calling thread for one call, or fail if it is in use */
+static int nuvoicp_enter(struct nuvoicp *ctx)
+{
+	if (!ctx)
+		return NUVOICP_ERR_ARG;
+	if (pthread_mutex_trylock(&ctx->lock))
+		return NUVOICP_ERR_BUSY;
+
+	ctx->prev = ctx_use(ctx->state);
+	return NUVOICP_OK;
+}
+
+static int nuvoicp_leave(struct nuvoicp *ctx, int ret)
+{
+	ctx_use(ctx->prev);
+	pthread_mutex_unlock(&ctx->lock);
+	return ret;
+}
+
+/* once per unit, every operation needs the device, a gang its targets */
+static int nuvoicp_ready(struct nuvoicp *ctx)
+{
+	if (pgm_num_targets() > 1) {
+		if (!ctx->gang_found)
+			ctx->gang_found = icp_gang_identify();
+		return ctx->gang_found ? NUVOICP_OK : NUVOICP_ERR_NO_TARGET;
+	}
+
+	if (session_announce(&ctx->session) < 0)
+		return ctx->session.cid != NUVOTON_ID ? NUVOICP_ERR_NO_TARGET : NUVOICP_ERR_DEVICE;
+
+	return NUVOICP_OK;
+}
+
+static int nuvoicp_do_open(struct nuvoicp *ctx, const struct nuvoicp_config *cfg)
+{
+	const int *dats = cfg->num_gang ? cfg->gang_gpios : &cfg->dat_gpio;
+
+	log_set_handler(cfg->log ? cfg->log : nuvoicp_log_drop, cfg->log_user);
+	perf_reset();
+
+	/* a journal resumes one unit, it cannot follow a gang */
+	if ((cfg->num_gang && (!cfg->gang_gpios || cfg->journal)) || pgm_select(ctx->backend) < 0 ||
+	    pgm_set_dat_gpios(dats, cfg->num_gang ? cfg->num_gang : 1) < 0 ||
+	    pgm_set_ctl_gpios(cfg->clk_gpio, cfg->rst_gpio) < 0)
+		return NUVOICP_ERR_ARG;
+
+	pgm_set_trace(cfg->trace);
+	if (pgm_init() < 0)
+		return NUVOICP_ERR_BACKEND;
+
+	if (cfg->hists)
+		timing_hist_enable();
+	perf_set_output(cfg->perf_json, cfg->perf_prom);
+	ctx->reports = cfg->hists || cfg->perf_json || cfg->perf_prom;
+
+	session_init(&ctx->session);
+
+	return NUVOICP_OK;
+}
+
+/*
+ * Open the transport with the pins of cfg, NULL for the defaults, and
+ * enter ICP mode. The target is identified by the first operation.
+ */
+int nuvoicp_open(struct nuvoicp **ctxp, const struct nuvoicp_config *cfg)
+{
+	struct nuvoicp_config def;
+	struct nuvoicp *ctx;
+	struct ctx *prev;
+	int ret;
+
+	*ctxp = NULL;
+	if (!cfg) {
+		nuvoicp_config_init(&def);
+		cfg = &def;
+	}
+
+	ctx = calloc(1, sizeof(*ctx));
+	if (!ctx)
+		return NUVOICP_ERR_NOMEM;
+	ctx->state = ctx_new();
+	if (!ctx->state || (cfg->backend && !(ctx->backend = strdup(cfg->backend))) ||
+	    (cfg->journal && !(ctx->journal = strdup(cfg->journal)))) {
+		ret = NUVOICP_ERR_NOMEM;
+		goto err;
+	}
+
+	prev = ctx_use(ctx->state);
+	ret = nuvoicp_do_open(ctx, cfg);
+	ctx_use(prev);
+	if (ret < 0)
+		goto err;
+
+	pthread_mutex_init(&ctx->lock, NULL);
+	*ctxp = ctx;
+
+	return NUVOICP_OK;
+
+err:
+	ctx_free(ctx->state);
+	free(ctx->backend);
+	free(ctx->journal);
+	free(ctx);
+	return ret;
+}
+
+/* release the target from reset and close the transport */
+void nuvoicp_close(struct nuvoicp *ctx)
+{
+	if (nuvoicp_enter(ctx) < 0)
+		return;
+
+	session_exit(&ctx->session);
+	pgm_deinit();
+	if (ctx->reports) {
+		timing_print_hists();
+		perf_report();
+	}
+	log_exit();
+	nuvoicp_leave(ctx, NUVOICP_OK);
+
+	pthread_mutex_destroy(&ctx->lock);
+	ctx_free(ctx->state);
+	free(ctx->backend);
+	free(ctx->journal);
+	free(ctx);
+}
+
+/* short reset back into ICP mode, for the next unit in the same socket */
+int nuvoicp_reset(struct nuvoicp *ctx)
+{
+	int ret = nuvoicp_enter(ctx);
+
+	if (ret < 0)
+		return ret;
+
+	ctx->gang_found = 0;
+	ret = session_reenter(&ctx->session) < 0 ? NUVOICP_ERR_NO_TARGET : NUVOICP_OK;
+	return nuvoicp_leave(ctx, ret);
+}
+
+/* cid and devid are filled in when a target answers with an unknown ID too */
+static int nuvoicp_do_identify(struct nuvoicp *ctx, struct nuvoicp_info *info)
+{
+	const struct icp_session *s = &ctx->session;
+	struct icp_layout layout;
+	int ret;
+
+	if (!info || pgm_num_targets() > 1)
+		return NUVOICP_ERR_ARG;
+
+	memset(info, 0, sizeof(*info));
+	ret = nuvoicp_ready(ctx);
+	info->cid = s->cid;
+	info->devid = s->devid;
+	if (ret < 0)
+		return ret;
+
+	info->name = s->dev->name;
+	memcpy(info->uid, s->uid, sizeof(info->uid));
+	info->flash_size = s->dev->flash_size;
+	info->page_size = s->dev->page_size;
+	memcpy(info->cfg, session_config(&ctx->session), sizeof(info->cfg));
+
+	icp_decode_config(info->cfg, &layout);
+	info->aprom_size = layout.aprom_size;
+	info->ldrom_size = layout.ldrom_size;
+	info->boot_ldrom = layout.boot_ldrom;
+
+	return NUVOICP_OK;
+}
+
+int nuvoicp_identify(struct nuvoicp *ctx, struct nuvoicp_info *info)
+{
+	int ret = nuvoicp_enter(ctx);
+
+	if (ret < 0)
+		return ret;
+
+	return nuvoicp_leave(ctx, nuvoicp_do_identify(ctx, info));
+}
+
+/* [addr, addr + len) of the flash, APROM followed by LDROM */
+static int nuvoicp_range(uint32_t addr, uint32_t len)
+{
+	uint32_t size = icp_dev->flash_size;
+
+	return addr > size || len > size - addr ? NUVOICP_ERR_RANGE : NUVOICP_OK;
+}
+
+static int nuvoicp_do_read(struct nuvoicp *ctx, uint32_t addr, uint8_t *buf, uint32_t len)
+{
+	int ret;
+
+	if (!buf || pgm_num_targets() > 1)
+		return NUVOICP_ERR_ARG;
+	if ((ret = nuvoicp_ready(ctx)) < 0)
+		return ret;
+	if ((ret = nuvoicp_range(addr, len)) < 0 || !len)
+		return ret;
+
+	icp_aprom_byte_read(addr, len, buf);
+
+	return NUVOICP_OK;
+}
+
+int nuvoicp_read(struct nuvoicp *ctx, uint32_t addr, uint8_t *buf, uint32_t len)
+{
+	int ret = nuvoicp_enter(ctx);
+
+	if (ret < 0)
+		return ret;
+
+	return nuvoicp_leave(ctx, nuvoicp_do_read(ctx, addr, buf, len));
+}
+
+static int nuvoicp_do_verify(struct nuvoicp *ctx, uint32_t addr, const uint8_t *buf,
+			     uint32_t len)
+{
+	int ret = nuvoicp_ready(ctx);
+
+	if (ret < 0)
+		return ret;
+	if (!buf)
+		return NUVOICP_ERR_ARG;
+	if ((ret = nuvoicp_range(addr, len)) < 0 || !len)
+		return ret;
+
+	ret = icp_range_verify(CMD_APROM_BYTE_READ, addr, len, buf);
+	if (ctx->gang_found)
+		icp_gang_report(ctx->gang_found);
+
+	return ret < 0 ? NUVOICP_ERR_VERIFY : NUVOICP_OK;
+}
+
+int nuvoicp_verify(struct nuvoicp *ctx, uint32_t addr, const uint8_t *buf, uint32_t len)
+{
+	int ret = nuvoicp_enter(ctx);
+
+	if (ret < 0)
+		return ret;
+
+	return nuvoicp_leave(ctx, nuvoicp_do_verify(ctx, addr, buf, len));
+}
+
+/*
+ * Run the plan on the identified target or gang. aprom is the APROM
+ * image, an empty one without, the cache and the journal go by it and
+ * plan->ldrom. A single target the cache lists with these images is left
+ * as it is.
+ */
+static int nuvoicp_run(struct nuvoicp *ctx, struct icp_plan *plan, const struct image *aprom)
+{
+	struct icp_session *s = &ctx->session;
+	const struct image *ldrom_src = plan->ldrom ? plan->ldrom : aprom;
+	uint64_t key = 0;
+	int ret = NUVOICP_OK;
+
+	/* both the cache and the journal go by the unit and the images */
+	if ((cache_enabled() || ctx->journal) && !ctx->gang_found && (plan->aprom || plan->ldrom)) {
+		key = cache_hash(aprom, ldrom_src);
+
+		/* units come back after rework, do not reflash what is already there */
+		if (cache_enabled() && cache_check(s->uid, key, aprom, ldrom_src)) {
+			log_info("Unit already holds this image, not reprogrammed\n");
+			return NUVOICP_OK;
+		}
+
+		if (ctx->journal && journal_open(ctx->journal, s->uid, key) < 0)
+			return NUVOICP_ERR_FILE;
+	}
+
+	if (session_program(s, plan) < 0)
+		ret = plan->cfg_ret < 0 ? NUVOICP_ERR_CONFIG : NUVOICP_ERR_VERIFY;
+
+	if (plan->cfg_ret < 0)
+		log_err("\nError when writing CONFIG!\n");
+	if (plan->ldrom && plan->ldrom_ret < 0)
+		log_err("\nError when verifying flash!\n");
+	else if (plan->ldrom)
+		log_info("\nLDROM verified successfully!\n");
+	if (plan->aprom && plan->aprom_ret < 0)
+		log_err("\nError when verifying flash!\n");
+	else if (plan->aprom)
+		log_info("\nAPROM verified successfully!\n");
+
+	journal_close(ret == NUVOICP_OK);
+
+	if (cache_enabled() && key && ret == NUVOICP_OK)
+		cache_store(s->uid, key);
+
+	if (ctx->gang_found)
+		icp_gang_report(ctx->gang_found);
+
+	return ret;
+}
+
+static int nuvoicp_do_erase(struct nuvoicp *ctx)
+{
+	static const struct image none;
+	struct icp_plan plan = { .erase = 1 };
+	int ret = nuvoicp_ready(ctx);
+
+	if (ret < 0)
+		return ret;
+
+	return nuvoicp_run(ctx, &plan, &none);
+}
+
+/* flash and CONFIG */
+int nuvoicp_erase(struct nuvoicp *ctx)
+{
+	int ret = nuvoicp_enter(ctx);
+
+	if (ret < 0)
+		return ret;
+
+	return nuvoicp_leave(ctx, nuvoicp_do_erase(ctx));
+}
+
+static int nuvoicp_do_program(struct nuvoicp *ctx, const uint8_t *aprom, uint32_t aprom_len,
+			      const uint8_t *ldrom, uint32_t ldrom_len, unsigned int flags)
+{
+	struct image aprom_img = { 0 }, ldrom_img = { 0 };
+	struct icp_plan plan = { 0 };
+	const struct icp_device *dev;
+	uint32_t ldrom_size = 0;
+	int ret;
+
+	if ((!aprom && aprom_len) || (!ldrom && ldrom_len) || (ldrom && !ldrom_len) ||
+	    (flags & ~(NUVOICP_DIFF | NUVOICP_PAGE_VERIFY)))
+		return NUVOICP_ERR_ARG;
+	if ((ret = nuvoicp_ready(ctx)) < 0)
+		return ret;
+
+	/* the session would truncate, a caller with buffers wants to know */
+	dev = icp_dev;
+	if (ldrom) {
+		if (ldrom_len > dev->ldrom_max)
+			return NUVOICP_ERR_RANGE;
+		ldrom_size = (ldrom_len + dev->ldrom_step - 1) / dev->ldrom_step * dev->ldrom_step;
+	} else if (flags & NUVOICP_DIFF) {
+		struct icp_layout layout;
+
+		icp_decode_config(session_config(&ctx->session), &layout);
+		ldrom_size = layout.ldrom_size;
+	}
+	if (aprom_len > dev->flash_size - ldrom_size)
+		return NUVOICP_ERR_RANGE;
+
+	if ((aprom && image_from_buf(&aprom_img, aprom, aprom_len, APROM_FLASH_ADDR) < 0) ||
+	    (ldrom && image_from_buf(&ldrom_img, ldrom, ldrom_len, LDROM_IMAGE_ADDR) < 0)) {
+		ret = NUVOICP_ERR_NOMEM;
+		goto out;
+	}
+
+	plan.aprom = aprom ? &aprom_img : NULL;
+	plan.ldrom = ldrom ? &ldrom_img : NULL;
+	plan.diff_mode = !!(flags & NUVOICP_DIFF);
+	plan.page_verify = !!(flags & NUVOICP_PAGE_VERIFY);
+
+	ret = nuvoicp_run(ctx, &plan, &aprom_img);
+
+out:
+	image_free(&aprom_img);
+	image_free(&ldrom_img);
+	return ret;
+}
+
+/*
+ * Program aprom to address 0 and, if given, ldrom to an LDROM of its
+ * size rounded up, which CONFIG is then set to boot from. Without
+ * NUVOICP_DIFF the chip is erased first, CONFIG included. Either image
+ * may be NULL. Nothing is written unless both fit.
+ */
+int nuvoicp_program(struct nuvoicp *ctx, const uint8_t *aprom, uint32_t aprom_len,
+		    const uint8_t *ldrom, uint32_t ldrom_len, unsigned int flags)
+{
+	int ret = nuvoicp_enter(ctx);
+
+	if (ret < 0)
+		return ret;
+
+	ret = nuvoicp_do_program(ctx, aprom, aprom_len, ldrom, ldrom_len, flags);
+	return nuvoicp_leave(ctx, ret);
+}
+
+static int nuvoicp_do_program_file(struct nuvoicp *ctx, const char *aprom, const char *ldrom,
+				   unsigned int flags)
+{
+	struct image aprom_img = { 0 }, ldrom_img = { 0 };
+	struct icp_plan plan = { 0 };
+	int ret;
+
+	if ((!aprom && !ldrom) || (flags & ~(NUVOICP_DIFF | NUVOICP_PAGE_VERIFY)))
+		return NUVOICP_ERR_ARG;
+
+	if ((aprom && image_load(&aprom_img, aprom, APROM_FLASH_ADDR) < 0) ||
+	    (ldrom && image_load(&ldrom_img, ldrom, LDROM_IMAGE_ADDR) < 0)) {
+		ret = NUVOICP_ERR_FILE;
+		goto out;
+	}
+
+	if ((ret = nuvoicp_ready(ctx)) < 0)
+		goto out;
+
+	/* a HEX/SREC image for APROM may carry LDROM as well */
+	plan.aprom = aprom ? &aprom_img : NULL;
+	if (ldrom)
+		plan.ldrom = &ldrom_img;
+	else if (image_bytes(&aprom_img, LDROM_IMAGE_ADDR, LDROM_MAX_SIZE))
+		plan.ldrom = &aprom_img;
+	plan.diff_mode = !!(flags & NUVOICP_DIFF);
+	plan.page_verify = !!(flags & NUVOICP_PAGE_VERIFY);
+
+	ret = nuvoicp_run(ctx, &plan, &aprom_img);
+
+out:
+	image_free(&aprom_img);
+	image_free(&ldrom_img);
+	return ret;
+}
+
+/*
+ * nuvoicp_program() with the images in the files aprom and ldrom, raw
+ * binary, Intel HEX or S-records, either may be NULL. A HEX/SREC image
+ * for APROM may carry LDROM and CONFIG as well. A unit the cache lists
+ * with these images is not programmed again.
+ */
+int nuvoicp_program_file(struct nuvoicp *ctx, const char *aprom, const char *ldrom,
+			 unsigned int flags)
+{
+	int ret = nuvoicp_enter(ctx);
+
+	if (ret < 0)
+		return ret;
+
+	ret = nuvoicp_do_program_file(ctx, aprom, ldrom, flags);
+	return nuvoicp_leave(ctx, ret);
+}
@@ -0,0 +1,124 @@
+/*
+ * nuvoicp - library interface
+ *
+ * Everything the command line tool does to a target, for programs that
+ * embed it and for the tool itself: a context per target, its pins and
+ * transport given at open, buffers or image files in and out, and error
+ * codes for results. Messages go to the log callback of the
+ * configuration and nowhere else.
+ *
+ * A context holds everything of its target, the backend, the ICP state
+ * and the log, and contexts are independent of each other:
+ *
+ *  - any number of contexts can be open, on one thread or on many, as
+ *    long as each is on pins of its own,
+ *  - a context can be used from any thread, but its calls must not
+ *    overlap, a call while another one on the same context is running
+ *    fails with NUVOICP_ERR_BUSY,
+ *  - the log callback runs inside the call that logs and must not call
+ *    into the same context.
+ *
+ * A context opened with gang_gpios drives a gang: program, erase and
+ * verify go to all targets that answer, the outcome of each is logged,
+ * and they fail only if every target does. Identify and read take a
+ * single target and fail with NUVOICP_ERR_ARG on a gang.
+ *
+ * To drive several targets concurrently, open one context each, on its
+ * own pins, and call them from threads of their own:
+ *
+ *	struct nuvoicp_config cfg;
+ *	struct nuvoicp *nv;
+ *
+ *	nuvoicp_config_init(&cfg);
+ *	cfg.dat_gpio = 16;
+ *	if (nuvoicp_open(&nv, &cfg) == NUVOICP_OK) {
+ *		ret = nuvoicp_program(nv, fw, fw_len, NULL, 0, 0);
+ *		nuvoicp_close(nv);
+ *	}
+ *
+ * Distributed under the same terms as nuvoicp.c, see there.
+ */
+
+#ifndef LIBNUVOICP_H
+#define LIBNUVOICP_H
+
+#include <stdint.h>
+
+#define NUVOICP_UID_LEN		12
+#define NUVOICP_CFG_LEN		5
+#define NUVOICP_MAX_TARGETS	8	/* of a gang */
+
+enum nuvoicp_error {
+	NUVOICP_OK		= 0,
+	NUVOICP_ERR_ARG		= -1,	/* bad argument or configuration */
+	NUVOICP_ERR_BUSY	= -2,	/* another call on the context is running */
+	NUVOICP_ERR_NOMEM	= -3,
+	NUVOICP_ERR_BACKEND	= -4,	/* the transport could not be opened */
+	NUVOICP_ERR_NO_TARGET	= -5,	/* nothing answers in ICP mode */
+	NUVOICP_ERR_DEVICE	= -6,	/* a device ID that is not supported */
+	NUVOICP_ERR_RANGE	= -7,	/* outside the flash, or does not fit */
+	NUVOICP_ERR_VERIFY	= -8,	/* flash does not read back as written */
+	NUVOICP_ERR_CONFIG	= -9,	/* CONFIG does not read back as written */
+	NUVOICP_ERR_FILE	= -10,	/* an image or the journal cannot be read or written */
+};
+
+/* log callback levels */
+#define NUVOICP_LOG_ERR		0
+#define NUVOICP_LOG_INFO	1
+#define NUVOICP_LOG_DEBUG	2
+
+struct nuvoicp;
+
+struct nuvoicp_config {
+	const char *backend;		/* like -b, e.g. "gpiod:gpiochip1", NULL for the default */
+	int clk_gpio;
+	int rst_gpio;
+	int dat_gpio;
+	/* gang programming, one target per DAT GPIO sharing CLK and RST, instead of dat_gpio */
+	const int *gang_gpios;
+	int num_gang;
+	const char *journal;		/* like -J, NULL for none, not with a gang */
+	const char *trace;		/* like -T, the VCD is written at close */
+	const char *perf_json;		/* like -j and -P, written at close */
+	const char *perf_prom;
+	int hists;			/* like -H, logged at close */
+	/* messages, not always whole lines, NULL to drop them */
+	void (*log)(int level, const char *msg, void *user);
+	void *log_user;
+};
+
+struct nuvoicp_info {
+	uint8_t cid;
+	uint16_t devid;
+	const char *name;
+	uint8_t uid[NUVOICP_UID_LEN];
+	uint32_t flash_size;		/* APROM and LDROM together */
+	uint32_t page_size;
+	uint8_t cfg[NUVOICP_CFG_LEN];
+	uint32_t aprom_size;		/* as CONFIG splits the flash */
+	uint32_t ldrom_size;
+	int boot_ldrom;
+};
+
+/* nuvoicp_program() flags */
+#define NUVOICP_DIFF		(1 << 0)	/* only pages that differ, no chip erase */
+#define NUVOICP_PAGE_VERIFY	(1 << 1)	/* verify each page right after writing it */
+
+void nuvoicp_config_init(struct nuvoicp_config *cfg);
+/* like -C, for all contexts of the process, NULL to turn it off */
+void nuvoicp_set_cache(const char *path);
+/* one per target, calls on a context must not overlap, see above */
+int nuvoicp_open(struct nuvoicp **ctx, const struct nuvoicp_config *cfg);
+void nuvoicp_close(struct nuvoicp *ctx);
+int nuvoicp_reset(struct nuvoicp *ctx);
+int nuvoicp_identify(struct nuvoicp *ctx, struct nuvoicp_info *info);
+int nuvoicp_read(struct nuvoicp *ctx, uint32_t addr, uint8_t *buf, uint32_t len);
+int nuvoicp_verify(struct nuvoicp *ctx, uint32_t addr, const uint8_t *buf, uint32_t len);
+int nuvoicp_erase(struct nuvoicp *ctx);
+int nuvoicp_program(struct nuvoicp *ctx, const uint8_t *aprom, uint32_t aprom_len,
+		    const uint8_t *ldrom, uint32_t ldrom_len, unsigned int flags);
+int nuvoicp_program_file(struct nuvoicp *ctx, const char *aprom, const char *ldrom,
+			 unsigned int flags);
+const char *nuvoicp_strerror(int err);
+
+#endif
@@ -0,0 +1,178 @@
+/*
+ * nuvoicp - production line loop
+ *
+ * Programs unit after unit with the images loaded once. The socket is
+ * polled with the ICP entry sequence until a supported chip identifies,
+ * twice with the same UID so a unit that is still being seated is not
+ * started on. It is programmed and verified with the plan of the command
+ * line, the result goes to the log with its UID, and the unit is kept in
+ * ICP mode until its CID stops answering, that is until it was pulled.
+ *
+ * The cycle time is from one insertion to the next, operator included,
+ * units per hour follow from its mean. Both are on the backend clock, so
+ * the simulator line (units=<n>) reports what the wire would take.
+ *
+ * Distributed under the same terms as nuvoicp.c, see there.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <signal.h>
+
+#include "line.h"
+#include "session.h"
+#include "icp.h"
+#include "cache.h"
+#include "image.h"
+#include "log.h"
+#include "pgm.h"
+
+#define LINE_POLL_MS		200
+#define LINE_GONE_POLLS		3	/* CID reads missing in a row for a pulled unit */
+
+struct line_stats {
+	int units;
+	int failed;
+	int cached;
+	uint64_t program_ns;
+	uint64_t cycle_ns, cycle_min_ns, cycle_max_ns;
+	int cycles;
+};
+
+static volatile sig_atomic_t stop;
+
+static void line_signal(int sig)
+{
+	stop = 1;
+}
+
+static double line_secs(uint64_t ns)
+{
+	return ns / 1e9;
+}
+
+/* wait for a supported chip to identify twice in a row, <0 if stopped */
+static int line_wait_unit(struct icp_session *s)
+{
+	uint8_t uid[ICP_UID_LEN];
+	int seen = 0;
+
+	while (!stop) {
+		if (session_reenter(s) == 0 && session_identify(s) == 0) {
+			if (seen && !memcmp(uid, s->uid, sizeof(uid)))
+				return 0;
+			memcpy(uid, s->uid, sizeof(uid));
+			seen = 1;
+		} else {
+			seen = 0;
+		}
+		pgm_usleep(LINE_POLL_MS * 1000);
+	}
+
+	return -1;
+}
+
+static void line_wait_removal(struct icp_session *s)
+{
+	for (int gone = 0; gone < LINE_GONE_POLLS && !stop; ) {
+		pgm_usleep(LINE_POLL_MS * 1000);
+		gone = icp_read_cid() == NUVOTON_ID ? 0 : gone + 1;
+	}
+
+	session_exit(s);
+}
+
+static void line_report(const struct line_stats *st)
+{
+	int programmed = st->units - st->cached;
+
+	log_info("\nLine: %d units, %d OK, %d failed, %d already programmed\n",
+		 st->units, st->units - st->failed - st->cached, st->failed, st->cached);
+	if (programmed)
+		log_info("Line: programming %.2f s per unit\n",
+			 line_secs(st->program_ns / programmed));
+	if (st->cycles)
+		log_info("Line: cycle %.2f s per unit (%.2f - %.2f s), %.0f units/hour\n",
+			 line_secs(st->cycle_ns / st->cycles), line_secs(st->cycle_min_ns),
+			 line_secs(st->cycle_max_ns), 3600.0 * st->cycles / line_secs(st->cycle_ns));
+}
+
+/*
+ * Run the line until max_units units went through, 0 for no limit, or
+ * until SIGINT/SIGTERM. Returns <0 if any unit failed.
+ */
+int line_run(struct icp_session *s, struct icp_plan *plan, int max_units)
+{
+	static const struct image no_image;
+	struct sigaction act = { .sa_handler = line_signal }, old_int, old_term;
+	const struct image *aprom = plan->aprom ? plan->aprom : &no_image;
+	const struct image *ldrom_src = plan->ldrom ? plan->ldrom : aprom;
+	uint64_t key = cache_hash(aprom, ldrom_src), t_prev = 0;
+	struct line_stats st = { 0 };
+
+	sigaction(SIGINT, &act, &old_int);
+	sigaction(SIGTERM, &act, &old_term);
+
+	log_info("Line: waiting for units\n");
+
+	while (!stop && (!max_units || st.units < max_units)) {
+		uint64_t t_plug, t_done;
+		char uid[2 * ICP_UID_LEN + 1];
+		const char *result;
+
+		if (line_wait_unit(s) < 0)
+			break;
+		t_plug = pgm_now_ns();
+
+		for (int i = 0; i < ICP_UID_LEN; i++)
+			sprintf(&uid[2 * i], "%02x", s->uid[i]);
+		log_info("\nUnit %d, %s, UID %s\n", st.units + 1, s->dev->name, uid);
+
+		/* units come back after rework, do not reflash what is already there */
+		if (cache_enabled() && cache_check(s->uid, key, aprom, ldrom_src)) {
+			result = "already programmed";
+			st.cached++;
+		} else {
+			if (session_program(s, plan) < 0) {
+				result = "FAILED";
+				st.failed++;
+			} else {
+				result = "OK";
+				if (cache_enabled())
+					cache_store(s->uid, key);
+			}
+			st.program_ns += pgm_now_ns() - t_plug;
+		}
+		t_done = pgm_now_ns();
+		st.units++;
+
+		if (t_prev) {
+			uint64_t cycle = t_plug - t_prev;
+
+			if (!st.cycles || cycle < st.cycle_min_ns)
+				st.cycle_min_ns = cycle;
+			if (cycle > st.cycle_max_ns)
+				st.cycle_max_ns = cycle;
+			st.cycle_ns += cycle;
+			st.cycles++;
+			log_info("Unit %d UID %s: %s in %.2f s, cycle %.2f s\n", st.units, uid, result,
+				 line_secs(t_done - t_plug), line_secs(cycle));
+		} else {
+			log_info("Unit %d UID %s: %s in %.2f s\n", st.units, uid, result,
+				 line_secs(t_done - t_plug));
+		}
+		t_prev = t_plug;
+
+		log_info("Line: pull the unit\n");
+		line_wait_removal(s);
+	}
+
+	line_report(&st);
+
+	sigaction(SIGINT, &old_int, NULL);
+	sigaction(SIGTERM, &old_term, NULL);
+
+	return st.failed ? -1 : 0;
+}
@@ -0,0 +1,15 @@
+/*
+ * nuvoicp - production line loop
+ *
+ * Distributed under the same terms as nuvoicp.c, see there.
+ */
+
+#ifndef LINE_H
+#define LINE_H
+
+struct icp_session;
+struct icp_plan;
+
+int line_run(struct icp_session *s, struct icp_plan *plan, int max_units);
+
+#endif
@@ -0,0 +1,147 @@
+/*
+ * nuvoicp - leveled logging
+ *
+ * Errors and info messages go straight to stderr, or to the handler
+ * the context set, which is how the library hands them over. Debug and trace
+ * messages are formatted into a ring buffer instead, which costs no
+ * syscall on the hot path. The ring is written out in one go when an
+ * error is logged, so the failure comes with the steps that led to it,
+ * and at exit when running verbose. Older messages are overwritten once
+ * the ring is full. The ring and the handler are per context, so targets
+ * driven side by side keep their traces apart.
+ *
+ * Building with LOG_LEVEL_MAX below LOG_DEBUG removes the calls and the
+ * formatting of their arguments entirely.
+ *
+ * Distributed under the same terms as nuvoicp.c, see there.
+ */
+
+#include <stdio.h>
+#include <stdarg.h>
+#include <string.h>
+
+#include "log.h"
+#include "ctx.h"
+
+#define LOG_LINE_MAX	256
+
+static int verbose;
+
+static void ring_put(struct log_state *l, const char *s, size_t len)
+{
+	while (len) {
+		size_t n = LOG_RING_SIZE - l->ring_pos < len ? LOG_RING_SIZE - l->ring_pos : len;
+
+		memcpy(&l->ring[l->ring_pos], s, n);
+		l->ring_pos += n;
+		s += n;
+		len -= n;
+		if (l->ring_pos == LOG_RING_SIZE) {
+			l->ring_pos = 0;
+			l->ring_wrapped = 1;
+		}
+	}
+}
+
+/* hand the ring out line by line at debug level */
+static void handler_put(struct log_state *l, const char *s, size_t len)
+{
+	char line[LOG_LINE_MAX];
+
+	while (len) {
+		const char *nl = memchr(s, '\n', len);
+		size_t n = nl ? (size_t)(nl - s) + 1 : len;
+		size_t copy = n < sizeof(line) ? n : sizeof(line) - 1;
+
+		memcpy(line, s, copy);
+		line[copy] = '\0';
+		l->handler(LOG_DEBUG, line, l->handler_user);
+		s += n;
+		len -= n;
+	}
+}
+
+static void flush_put(struct log_state *l, const char *s, size_t len)
+{
+	if (l->handler)
+		handler_put(l, s, len);
+	else
+		fwrite(s, 1, len, stderr);
+}
+
+void log_msg(int level, const char *fmt, ...)
+{
+	struct log_state *l = &ctx_cur->log;
+	char line[LOG_LINE_MAX];
+	va_list ap;
+	int n;
+
+	if (level <= LOG_INFO) {
+		if (level == LOG_ERR)
+			log_flush();
+		va_start(ap, fmt);
+		if (l->handler) {
+			vsnprintf(line, sizeof(line), fmt, ap);
+			l->handler(level, line, l->handler_user);
+		} else {
+			vfprintf(stderr, fmt, ap);
+		}
+		va_end(ap);
+		return;
+	}
+
+	va_start(ap, fmt);
+	n = vsnprintf(line, sizeof(line), fmt, ap);
+	va_end(ap);
+
+	if (n < 0)
+		return;
+	if (n >= sizeof(line)) {
+		n = sizeof(line) - 1;
+		line[n - 1] = '\n';
+	}
+	ring_put(l, line, n);
+}
+
+void log_set_verbose(int v)
+{
+	verbose = v;
+}
+
+/*
+ * Errors and info of the current context go to fn instead of stderr, and
+ * the trace ring when it is flushed, NULL to go back to stderr. Each call
+ * gets what one message formatted, which need not be a whole line.
+ */
+void log_set_handler(void (*fn)(int level, const char *msg, void *user), void *user)
+{
+	ctx_cur->log.handler = fn;
+	ctx_cur->log.handler_user = user;
+}
+
+/* write out and empty the trace ring, starting at the oldest whole line */
+void log_flush(void)
+{
+	struct log_state *l = &ctx_cur->log;
+
+	if (l->ring_wrapped) {
+		char *nl = memchr(&l->ring[l->ring_pos], '\n', LOG_RING_SIZE - l->ring_pos);
+
+		static const char dropped[] = "[earlier trace messages dropped]\n";
+
+		flush_put(l, dropped, sizeof(dropped) - 1);
+		if (nl)
+			flush_put(l, nl + 1, &l->ring[LOG_RING_SIZE] - (nl + 1));
+	}
+	flush_put(l, l->ring, l->ring_pos);
+
+	l->ring_pos = 0;
+	l->ring_wrapped = 0;
+}
+
+/* the trace only ends up on stderr when asked for, or after an error */
+void log_exit(void)
+{
+	if (verbose)
+		log_flush();
+}
@@ -0,0 +1,50 @@
+/*
+ * nuvoicp - leveled logging
+ *
+ * Distributed under the same terms as nuvoicp.c, see there.
+ */
+
+#ifndef LOG_H
+#define LOG_H
+
+#include <stddef.h>
+
+#define LOG_ERR		0	/* failures, flush the trace ring first */
+#define LOG_INFO	1	/* results the user waits for */
+#define LOG_DEBUG	2	/* steps of the protocol */
+#define LOG_TRACE	3	/* every command frame and byte */
+
+/* levels above this are compiled out, arguments are not evaluated */
+#ifndef LOG_LEVEL_MAX
+#define LOG_LEVEL_MAX	LOG_TRACE
+#endif
+
+#define log_at(level, ...) \
+	do { \
+		if ((level) <= LOG_LEVEL_MAX) \
+			log_msg(level, __VA_ARGS__); \
+	} while (0)
+
+#define LOG_RING_SIZE	(256 * 1024)
+
+/* per context, see ctx.h */
+struct log_state {
+	char ring[LOG_RING_SIZE];
+	size_t ring_pos;
+	int ring_wrapped;
+	void (*handler)(int level, const char *msg, void *user);
+	void *handler_user;
+};
+
+#define log_err(...)	log_at(LOG_ERR, __VA_ARGS__)
+#define log_info(...)	log_at(LOG_INFO, __VA_ARGS__)
+#define log_debug(...)	log_at(LOG_DEBUG, __VA_ARGS__)
+#define log_trace(...)	log_at(LOG_TRACE, __VA_ARGS__)
+
+void log_msg(int level, const char *fmt, ...) __attribute__((format(printf, 2, 3)));
+void log_set_verbose(int verbose);
+void log_set_handler(void (*fn)(int level, const char *msg, void *user), void *user);
+void log_flush(void);
+void log_exit(void);
+
+#endif
@@ -0,0 +1,206 @@
+/*
+ * nuvoicp - per phase performance counters
+ *
+ * The ICP code brackets its steps with perf_begin()/perf_end(), the
+ * outermost bracket decides the phase, so the reads of a config dump
+ * count as config and not as read. Wall time goes to whatever phase is
+ * running, GPIO calls, bits, bytes and delays are counted where they
+ * happen. perf_report() writes the counters as JSON and as a Prometheus
+ * textfile, for the node_exporter textfile collector.
+ *
+ * Distributed under the same terms as nuvoicp.c, see there.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+
+#include "perf.h"
+#include "timing.h"
+#include "ctx.h"
+
+static const char *phase_names[PERF_NUM_PHASES] = {
+	[PERF_OTHER]	= "other",
+	[PERF_ENTRY]	= "entry",
+	[PERF_IDENTIFY]	= "identify",
+	[PERF_CONFIG]	= "config",
+	[PERF_ERASE]	= "erase",
+	[PERF_WRITE]	= "write",
+	[PERF_VERIFY]	= "verify",
+	[PERF_READ]	= "read",
+	[PERF_EXIT]	= "exit",
+};
+
+static void perf_switch(enum perf_phase phase)
+{
+	struct perf_state *ps = &ctx_cur->perf;
+	uint64_t now = timing_now_ns();
+
+	ps->cur->wall_ns += now - ps->switch_ns;
+	ps->switch_ns = now;
+	ps->cur = &ps->counters[phase];
+}
+
+/* counting before perf_reset() goes to the other phase */
+void perf_ctx_init(struct perf_state *ps)
+{
+	ps->cur = &ps->counters[PERF_OTHER];
+}
+
+void perf_reset(void)
+{
+	struct perf_state *ps = &ctx_cur->perf;
+
+	memset(ps->counters, 0, sizeof(ps->counters));
+	ps->cur = &ps->counters[PERF_OTHER];
+	ps->depth = 0;
+	ps->start_ns = ps->switch_ns = timing_now_ns();
+}
+
+void perf_begin(enum perf_phase phase)
+{
+	if (!ctx_cur->perf.depth++)
+		perf_switch(phase);
+}
+
+void perf_end(void)
+{
+	struct perf_state *ps = &ctx_cur->perf;
+
+	if (ps->depth && !--ps->depth)
+		perf_switch(PERF_OTHER);
+}
+
+void perf_set_output(const char *json_path, const char *prom_path)
+{
+	ctx_cur->perf.json_out = json_path;
+	ctx_cur->perf.prom_out = prom_path;
+}
+
+static void write_json(FILE *f, uint64_t total_ns)
+{
+	fprintf(f, "{\"wall_s\":%.6f,\"phases\":{", total_ns / 1e9);
+
+	for (int p = 0; p < PERF_NUM_PHASES; p++) {
+		const struct perf_counters *c = &ctx_cur->perf.counters[p];
+
+		fprintf(f, "%s\"%s\":{\"wall_s\":%.6f,\"gpio_calls\":%llu,\"bits\":%llu,"
+			"\"bytes_written\":%llu,\"bytes_read\":%llu,"
+			"\"sleep_requested_s\":%.6f,\"sleep_actual_s\":%.6f}",
+			p ? "," : "", phase_names[p], c->wall_ns / 1e9,
+			(unsigned long long)c->gpio_calls, (unsigned long long)c->bits,
+			(unsigned long long)c->bytes_written, (unsigned long long)c->bytes_read,
+			c->sleep_requested_ns / 1e9, c->sleep_actual_ns / 1e9);
+	}
+
+	fprintf(f, "}}\n");
+}
+
+static void write_prom_metric(FILE *f, const char *name, const char *help, int seconds,
+			      size_t offset)
+{
+	fprintf(f, "# HELP nuvoicp_phase_%s %s\n# TYPE nuvoicp_phase_%s gauge\n",
+		name, help, name);
+
+	for (int p = 0; p < PERF_NUM_PHASES; p++) {
+		uint64_t val = *(const uint64_t *)((const char *)&ctx_cur->perf.counters[p] + offset);
+
+		if (seconds)
+			fprintf(f, "nuvoicp_phase_%s{phase=\"%s\"} %.9f\n", name,
+				phase_names[p], val / 1e9);
+		else
+			fprintf(f, "nuvoicp_phase_%s{phase=\"%s\"} %llu\n", name,
+				phase_names[p], (unsigned long long)val);
+	}
+}
+
+static void write_prom(FILE *f, uint64_t total_ns)
+{
+	fprintf(f, "# HELP nuvoicp_run_seconds Wall time of the last run.\n"
+		"# TYPE nuvoicp_run_seconds gauge\n"
+		"nuvoicp_run_seconds %.9f\n", total_ns / 1e9);
+	fprintf(f, "# HELP nuvoicp_run_timestamp_seconds End of the last run.\n"
+		"# TYPE nuvoicp_run_timestamp_seconds gauge\n"
+		"nuvoicp_run_timestamp_seconds %llu\n", (unsigned long long)time(NULL));
+
+	write_prom_metric(f, "seconds", "Wall time per phase of the last run.", 1,
+			  offsetof(struct perf_counters, wall_ns));
+	write_prom_metric(f, "gpio_calls", "Backend GPIO calls per phase of the last run.", 0,
+			  offsetof(struct perf_counters, gpio_calls));
+	write_prom_metric(f, "bits", "ICP bits clocked per phase of the last run.", 0,
+			  offsetof(struct perf_counters, bits));
+	write_prom_metric(f, "bytes_written", "Bytes written per phase of the last run.", 0,
+			  offsetof(struct perf_counters, bytes_written));
+	write_prom_metric(f, "bytes_read", "Bytes read per phase of the last run.", 0,
+			  offsetof(struct perf_counters, bytes_read));
+	write_prom_metric(f, "sleep_requested_seconds",
+			  "Protocol delays requested per phase of the last run.", 1,
+			  offsetof(struct perf_counters, sleep_requested_ns));
+	write_prom_metric(f, "sleep_actual_seconds",
+			  "Protocol delays actually spent per phase of the last run.", 1,
+			  offsetof(struct perf_counters, sleep_actual_ns));
+}
+
+/* a half written file must never be picked up, write aside and rename */
+static void write_file(const char *path, void (*write)(FILE *, uint64_t), uint64_t total_ns)
+{
+	char tmp[4096];
+	FILE *f;
+
+	if (!strcmp(path, "-")) {
+		write(stdout, total_ns);
+		fflush(stdout);
+		return;
+	}
+
+	snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+	f = fopen(tmp, "w");
+	if (!f) {
+		fprintf(stderr, "Writing %s failed: %s\n", tmp, strerror(errno));
+		return;
+	}
+
+	write(f, total_ns);
+	if (fclose(f) || rename(tmp, path) < 0)
+		fprintf(stderr, "Writing %s failed: %s\n", path, strerror(errno));
+}
+
+/* close the running phase and write the counters to the configured outputs */
+void perf_report(void)
+{
+	struct perf_state *ps = &ctx_cur->perf;
+	uint64_t total_ns;
+
+	perf_switch(ps->cur - ps->counters);
+	total_ns = ps->switch_ns - ps->start_ns;
+
+	if (ps->json_out)
+		write_file(ps->json_out, write_json, total_ns);
+	if (ps->prom_out)
+		write_file(ps->prom_out, write_prom, total_ns);
+}
+
+/* all phases added up, the running one included */
+void perf_total(struct perf_counters *sum)
+{
+	struct perf_state *ps = &ctx_cur->perf;
+
+	perf_switch(ps->cur - ps->counters);
+	memset(sum, 0, sizeof(*sum));
+
+	for (int p = 0; p < PERF_NUM_PHASES; p++) {
+		const struct perf_counters *c = &ps->counters[p];
+
+		sum->wall_ns += c->wall_ns;
+		sum->gpio_calls += c->gpio_calls;
+		sum->bits += c->bits;
+		sum->bytes_written += c->bytes_written;
+		sum->bytes_read += c->bytes_read;
+		sum->sleep_requested_ns += c->sleep_requested_ns;
+		sum->sleep_actual_ns += c->sleep_actual_ns;
+	}
+}
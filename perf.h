@@ -0,0 +1,56 @@
+/*
+ * nuvoicp - per phase performance counters
+ *
+ * Distributed under the same terms as nuvoicp.c, see there.
+ */
+
+#ifndef PERF_H
+#define PERF_H
+
+#include <stdint.h>
+
+enum perf_phase {
+	PERF_OTHER,
+	PERF_ENTRY,
+	PERF_IDENTIFY,
+	PERF_CONFIG,
+	PERF_ERASE,
+	PERF_WRITE,
+	PERF_VERIFY,
+	PERF_READ,
+	PERF_EXIT,
+	PERF_NUM_PHASES,
+};
+
+struct perf_counters {
+	uint64_t wall_ns;
+	uint64_t gpio_calls;
+	uint64_t bits;
+	uint64_t bytes_written;
+	uint64_t bytes_read;
+	uint64_t sleep_requested_ns;
+	uint64_t sleep_actual_ns;
+};
+
+/* per context, see ctx.h */
+struct perf_state {
+	struct perf_counters counters[PERF_NUM_PHASES];
+	struct perf_counters *cur;	/* of the running phase */
+	int depth;
+	uint64_t start_ns, switch_ns;
+	const char *json_out, *prom_out;
+};
+
+/* counters of the running phase, cheap enough for the hot path, needs ctx.h */
+#define perf_cur		(ctx_cur->perf.cur)
+#define perf_count(field, n)	(perf_cur->field += (n))
+
+void perf_ctx_init(struct perf_state *ps);
+void perf_reset(void);
+void perf_begin(enum perf_phase phase);
+void perf_end(void);
+void perf_set_output(const char *json_path, const char *prom_path);
+void perf_report(void);
+void perf_total(struct perf_counters *sum);
+
+#endif
@@ -0,0 +1,322 @@
+/*
+ * nuvoicp - transport backend selection and dispatch
+ *
+ * Distributed under the same terms as nuvoicp.c, see there.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+
+#include "pgm.h"
+#include "perf.h"
+#include "timing.h"
+#include "log.h"
+#include "ctx.h"
+
+static const struct pgm_backend *backends[] = {
+#ifndef NO_GPIOD
+	&pgm_gpiod_backend,
+#endif
+	&pgm_gpiomem_backend,
+	&pgm_sim_backend,
+};
+
+#define NUM_BACKENDS (sizeof(backends) / sizeof(backends[0]))
+
+/* the first backend in the table is the default, GPIO_* the default pins */
+void pgm_ctx_init(struct pgm_state *ps)
+{
+	ps->dat_out = -1;
+	ps->dat_gpios[0] = GPIO_DAT;
+	ps->num_targets = 1;
+	ps->clk_gpio = GPIO_CLK;
+	ps->rst_gpio = GPIO_RST;
+}
+
+/* NULL for the default backend */
+int pgm_select(const char *spec)
+{
+	struct pgm_state *ps = &ctx_cur->pgm;
+	const char *sep;
+	size_t len;
+
+	if (!spec) {
+		ps->selected = NULL;
+		ps->backend_arg = NULL;
+		return 0;
+	}
+
+	sep = strchr(spec, ':');
+	len = sep ? (size_t)(sep - spec) : strlen(spec);
+
+	for (int i = 0; i < NUM_BACKENDS; i++) {
+		if (strlen(backends[i]->name) == len &&
+		    !strncmp(backends[i]->name, spec, len)) {
+			ps->selected = backends[i];
+			ps->backend_arg = sep ? sep + 1 : NULL;
+			return 0;
+		}
+	}
+
+	log_err("Unknown backend '%s'\n", spec);
+	return -EINVAL;
+}
+
+void pgm_list_backends(void)
+{
+	for (int i = 0; i < NUM_BACKENDS; i++)
+		fprintf(stderr, "\t  %-8s %s%s\n", backends[i]->name,
+			backends[i]->help, i ? "" : " (default)");
+}
+
+int pgm_set_dat_gpios(const int *gpios, int num)
+{
+	if (num < 1 || num > PGM_MAX_TARGETS) {
+		log_err("Between 1 and %d DAT lines are supported\n",
+			PGM_MAX_TARGETS);
+		return -EINVAL;
+	}
+
+	for (int i = 0; i < num; i++) {
+		for (int j = 0; j < i; j++) {
+			if (gpios[j] == gpios[i])
+				goto bad;
+		}
+		if (gpios[i] < 0)
+			goto bad;
+	}
+
+	memcpy(ctx_cur->pgm.dat_gpios, gpios, num * sizeof(*gpios));
+	ctx_cur->pgm.num_targets = num;
+
+	return 0;
+
+bad:
+	log_err("DAT needs a different GPIO per target\n");
+	return -EINVAL;
+}
+
+/*
+ * -g and -p may come in either order, so the DAT lines are only checked
+ * against CLK and RST once both are known.
+ */
+static int pgm_check_gpios(void)
+{
+	const struct pgm_state *ps = &ctx_cur->pgm;
+
+	for (int i = 0; i < ps->num_targets; i++) {
+		if (ps->dat_gpios[i] == ps->clk_gpio || ps->dat_gpios[i] == ps->rst_gpio) {
+			log_err("GPIO %d can't be both DAT and CLK or RST\n", ps->dat_gpios[i]);
+			return -EINVAL;
+		}
+	}
+
+	return 0;
+}
+
+int pgm_num_targets(void)
+{
+	return ctx_cur->pgm.num_targets;
+}
+
+const int *pgm_dat_gpios(void)
+{
+	return ctx_cur->pgm.dat_gpios;
+}
+
+/* CLK and RST of the next pgm_init(), GPIO_CLK and GPIO_RST until then */
+int pgm_set_ctl_gpios(int clk, int rst)
+{
+	if (clk < 0 || rst < 0 || clk == rst) {
+		log_err("CLK and RST need two different GPIOs\n");
+		return -EINVAL;
+	}
+
+	ctx_cur->pgm.clk_gpio = clk;
+	ctx_cur->pgm.rst_gpio = rst;
+
+	return 0;
+}
+
+int pgm_clk_gpio(void)
+{
+	return ctx_cur->pgm.clk_gpio;
+}
+
+int pgm_rst_gpio(void)
+{
+	return ctx_cur->pgm.rst_gpio;
+}
+
+/* trace the lines of the next pgm_init() into a VCD file */
+void pgm_set_trace(const char *path)
+{
+	ctx_cur->pgm.trace_path = path;
+}
+
+int pgm_init(void)
+{
+	struct pgm_state *ps = &ctx_cur->pgm;
+	int ret;
+
+	if (pgm_check_gpios() < 0)
+		return -EINVAL;
+
+	ps->backend = ps->selected ? ps->selected : backends[0];
+	ps->dat_out = -1;
+
+	ret = ps->backend->init(ps->backend_arg);
+	if (ret < 0 && ps->backend->fallback && !ps->backend_arg) {
+		log_info("Backend %s unavailable, falling back to %s\n",
+			ps->backend->name, ps->backend->fallback);
+		if (pgm_select(ps->backend->fallback) < 0)
+			return ret;
+		ps->backend = ps->selected;
+		ret = ps->backend->init(ps->backend_arg);
+	}
+
+	if (ret >= 0 && ps->trace_path) {
+		const struct pgm_backend *traced = pgm_trace_wrap(ps->backend, ps->trace_path);
+
+		if (!traced) {
+			ps->backend->deinit();
+			return -ENOMEM;
+		}
+		ps->backend = traced;
+	}
+
+	return ret;
+}
+
+void pgm_set_dat(int val)
+{
+	perf_count(gpio_calls, 1);
+	ctx_cur->pgm.backend->set_dats(val ? (1U << ctx_cur->pgm.num_targets) - 1 : 0);
+}
+
+/* the first target's DAT, all there is without gang programming */
+int pgm_get_dat(void)
+{
+	perf_count(gpio_calls, 1);
+	return ctx_cur->pgm.backend->get_dats() & 1;
+}
+
+void pgm_set_dats(uint32_t vals)
+{
+	perf_count(gpio_calls, 1);
+	ctx_cur->pgm.backend->set_dats(vals);
+}
+
+uint32_t pgm_get_dats(void)
+{
+	perf_count(gpio_calls, 1);
+	return ctx_cur->pgm.backend->get_dats();
+}
+
+void pgm_set_rst(int val)
+{
+	perf_count(gpio_calls, 1);
+	ctx_cur->pgm.backend->set_rst(val);
+}
+
+void pgm_set_clk(int val)
+{
+	perf_count(gpio_calls, 1);
+	ctx_cur->pgm.backend->set_clk(val);
+}
+
+void pgm_set_lines(unsigned int mask, unsigned int vals)
+{
+	const struct pgm_backend *backend = ctx_cur->pgm.backend;
+
+	if (backend->set_lines) {
+		perf_count(gpio_calls, 1);
+		backend->set_lines(mask, vals);
+		return;
+	}
+
+	if ((mask & PGM_CLK) && !(vals & PGM_CLK))
+		pgm_set_clk(0);
+	if (mask & PGM_DAT)
+		pgm_set_dat(!!(vals & PGM_DAT));
+	if (mask & PGM_RST)
+		pgm_set_rst(!!(vals & PGM_RST));
+	if ((mask & PGM_CLK) && (vals & PGM_CLK))
+		pgm_set_clk(1);
+}
+
+void pgm_dat_dir(int state)
+{
+	struct pgm_state *ps = &ctx_cur->pgm;
+
+	/* icp_bitsend() asks for output on every call, mostly it already is */
+	if (state == ps->dat_out)
+		return;
+
+	ps->dat_out = state;
+	perf_count(gpio_calls, 1);
+	ps->backend->dat_dir(state);
+}
+
+void pgm_usleep(unsigned int usec)
+{
+	uint64_t start = timing_now_ns();
+
+	ctx_cur->pgm.backend->usleep(usec);
+
+	perf_count(sleep_requested_ns, usec * 1000ULL);
+	perf_count(sleep_actual_ns, timing_now_ns() - start);
+}
+
+static void pgm_step_marks(unsigned int marks)
+{
+	if (marks & PGM_BREAK_BIT)
+		timing_mark_break(TIMING_HIST_BIT);
+	if (marks & PGM_BREAK_BYTE)
+		timing_mark_break(TIMING_HIST_BYTE);
+	if (marks & PGM_MARK_BIT)
+		timing_mark(TIMING_HIST_BIT);
+	if (marks & PGM_MARK_BYTE)
+		timing_mark(TIMING_HIST_BYTE);
+}
+
+/*
+ * Play out a precompiled waveform. Goes to the backend directly, one
+ * call per step, without the per call bookkeeping of pgm_set_lines().
+ * The DAT direction is left alone, the caller sets it beforehand.
+ */
+void pgm_play(const struct pgm_step *steps, int num)
+{
+	void (*set_lines)(unsigned int, unsigned int) = ctx_cur->pgm.backend->set_lines;
+
+	if (set_lines)
+		perf_count(gpio_calls, num);
+
+	for (const struct pgm_step *s = steps; s < steps + num; s++) {
+		if (s->marks)
+			pgm_step_marks(s->marks);
+		if (set_lines)
+			set_lines(s->mask, s->vals);
+		else
+			pgm_set_lines(s->mask, s->vals);
+		if (s->delay_us)
+			pgm_usleep(s->delay_us);
+	}
+}
+
+/* time as the target sees it, wall time unless the backend keeps its own */
+uint64_t pgm_now_ns(void)
+{
+	const struct pgm_backend *backend = ctx_cur->pgm.backend;
+
+	return backend->now_ns ? backend->now_ns() : timing_now_ns();
+}
+
+void pgm_deinit(void)
+{
+	/* release reset */
+	pgm_set_rst(1);
+
+	ctx_cur->pgm.backend->deinit();
+}
@@ -0,0 +1,149 @@
+/*
+ * nuvoicp, a RPi ICP flasher for the Nuvoton N76E003
+ * https://github.com/steve-m/N76E003-playground
+ *
+ * Copyright (c) 2021 Steve Markgraf <steve@steve-m.de>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#ifndef PGM_H
+#define PGM_H
+
+#include <stdint.h>
+
+/* default GPIO line numbers for RPi, see pgm_set_dat_gpios() and pgm_set_ctl_gpios() */
+#define GPIO_DAT	20
+#define GPIO_RST	21
+#define GPIO_CLK	26
+
+#define CONSUMER "nuvoicp"
+
+/* gang programming: targets share CLK and RST, each has its own DAT */
+#define PGM_MAX_TARGETS	8
+
+/* line masks for pgm_set_lines() */
+#define PGM_DAT		(1 << 0)
+#define PGM_CLK		(1 << 1)
+#define PGM_RST		(1 << 2)
+
+/*
+ * One step of a precompiled waveform, see pgm_play(). The lines in mask
+ * change to vals like with pgm_set_lines(), then the backend waits
+ * delay_us. Histogram marks are taken before the lines change.
+ */
+struct pgm_step {
+	uint8_t mask;
+	uint8_t vals;
+	uint8_t marks;
+	uint32_t delay_us;
+};
+
+/* pgm_step marks */
+#define PGM_MARK_BIT		(1 << 0)
+#define PGM_MARK_BYTE		(1 << 1)
+#define PGM_BREAK_BIT		(1 << 2)
+#define PGM_BREAK_BYTE		(1 << 3)
+
+/*
+ * A transport backend drives the three ICP lines. Backends are selected
+ * at runtime with pgm_select() before pgm_init() is called, the optional
+ * argument after the ':' in the selection string is handed to init().
+ * A backend that fails to initialize without an argument is replaced by
+ * its fallback, if it names one.
+ *
+ * There is one DAT line per target, set_dats() and get_dats() take and
+ * return one bit per target, bit 0 being the first one. All DAT lines
+ * switch direction together.
+ *
+ * set_lines() is optional and changes several lines with one call, PGM_DAT
+ * meaning all DAT lines. It must apply a falling CLK edge before and a
+ * rising CLK edge after the other lines, so data set together with a clock
+ * edge still meets setup time.
+ *
+ * now_ns() is optional as well, the backend's own clock if it has one,
+ * like the virtual time of the simulator.
+ */
+struct pgm_backend {
+	const char *name;
+	const char *help;
+	const char *fallback;
+	int (*init)(const char *arg);
+	void (*deinit)(void);
+	void (*set_dats)(uint32_t vals);
+	uint32_t (*get_dats)(void);
+	void (*set_rst)(int val);
+	void (*set_clk)(int val);
+	void (*set_lines)(unsigned int mask, unsigned int vals);
+	void (*dat_dir)(int state);
+	void (*usleep)(unsigned int usec);
+	uint64_t (*now_ns)(void);
+};
+
+/*
+ * Per context, see ctx.h. A backend keeps its own state in priv, set up
+ * by init() and released by deinit(), the tracer in front of it in trace.
+ */
+struct pgm_state {
+	const struct pgm_backend *selected;	/* NULL for the default */
+	const char *backend_arg;
+	const struct pgm_backend *backend;	/* the tracer if tracing */
+	void *priv;
+	void *trace;
+	const char *trace_path;		/* VCD file, NULL if not tracing */
+	int dat_out;			/* -1 until the first pgm_dat_dir() */
+	int dat_gpios[PGM_MAX_TARGETS];
+	int num_targets;
+	int clk_gpio, rst_gpio;
+};
+
+#ifndef NO_GPIOD
+extern const struct pgm_backend pgm_gpiod_backend;
+#endif
+extern const struct pgm_backend pgm_gpiomem_backend;
+extern const struct pgm_backend pgm_sim_backend;
+
+void pgm_ctx_init(struct pgm_state *ps);
+int pgm_select(const char *spec);
+void pgm_list_backends(void);
+int pgm_set_dat_gpios(const int *gpios, int num);
+int pgm_num_targets(void);
+const int *pgm_dat_gpios(void);
+int pgm_set_ctl_gpios(int clk, int rst);
+int pgm_clk_gpio(void);
+int pgm_rst_gpio(void);
+void pgm_set_trace(const char *path);
+const struct pgm_backend *pgm_trace_wrap(const struct pgm_backend *b, const char *path);
+
+int pgm_init(void);
+void pgm_set_dat(int val);
+int pgm_get_dat(void);
+void pgm_set_dats(uint32_t vals);
+uint32_t pgm_get_dats(void);
+void pgm_set_rst(int val);
+void pgm_set_clk(int val);
+void pgm_set_lines(unsigned int mask, unsigned int vals);
+void pgm_dat_dir(int state);
+void pgm_usleep(unsigned int usec);
+void pgm_play(const struct pgm_step *steps, int num);
+uint64_t pgm_now_ns(void);
+void pgm_deinit(void);
+
+#endif
@@ -0,0 +1,386 @@
+/*
+ * nuvoicp - libgpiod transport backend
+ *
+ * Copyright (c) 2021 Steve Markgraf <steve@steve-m.de>
+ *
+ * Distributed under the same terms as nuvoicp.c, see there.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <gpiod.h>
+#include <errno.h>
+
+#include "pgm.h"
+#include "timing.h"
+#include "log.h"
+#include "ctx.h"
+
+/* per context, in ctx_cur->pgm.priv */
+struct lg {
+	struct gpiod_chip *chip;
+	struct gpiod_line *rst_line, *clk_line;
+	struct gpiod_line_bulk dat_bulk;	/* one DAT line per target */
+	int num_dat;
+	int can_reconfig;
+
+	/*
+	 * Bulk mode requests the DAT lines, CLK and RST as one handle so a
+	 * data bit and a clock edge go out with a single set-values ioctl. A
+	 * v1 line handle has one direction for all its lines, so while DAT is
+	 * an input the handle is split into the DAT lines and CLK+RST as a
+	 * second bulk.
+	 */
+	int bulk, split;
+	struct gpiod_line_bulk all_bulk, ctl_bulk;
+	int vals[PGM_MAX_TARGETS + 2];	/* DAT lines, then CLK and RST */
+};
+
+#define VAL_CLK	(lg->num_dat)
+#define VAL_RST	(lg->num_dat + 1)
+
+/* switch the requested DAT lines in place, one SET_CONFIG ioctl */
+static int lg_set_direction(int state, const int *zeros)
+{
+	struct lg *lg = ctx_cur->pgm.priv;
+
+#ifdef GPIOD_NO_SET_DIRECTION
+	/* libgpiod before 1.5, fail like an old kernel so they are re-requested */
+	errno = ENOTTY;
+	return -1;
+#else
+	if (state)
+		return gpiod_line_set_direction_output_bulk(&lg->dat_bulk, zeros);
+
+	return gpiod_line_set_direction_input_bulk(&lg->dat_bulk);
+#endif
+}
+
+static int lg_parse_args(const char *arg, char *name, size_t len)
+{
+	struct lg *lg = ctx_cur->pgm.priv;
+	char *args, *opt, *save = NULL;
+	int ret = 0;
+
+	snprintf(name, len, "gpiochip0");
+	if (!arg)
+		return 0;
+
+	args = strdup(arg);
+	for (opt = strtok_r(args, ",", &save); opt; opt = strtok_r(NULL, ",", &save)) {
+		if (!strcmp(opt, "bulk")) {
+			lg->bulk = 1;
+		} else if (!strchr(opt, '=')) {
+			snprintf(name, len, "%s", opt);
+		} else {
+			log_err("gpiod: bad backend argument '%s'\n", opt);
+			ret = -EINVAL;
+			break;
+		}
+	}
+
+	free(args);
+	return ret;
+}
+
+static int lg_request_split(void)
+{
+	struct lg *lg = ctx_cur->pgm.priv;
+	int ret;
+
+	ret = gpiod_line_request_bulk_input(&lg->dat_bulk, CONSUMER);
+	ret |= gpiod_line_request_bulk_output(&lg->ctl_bulk, CONSUMER, &lg->vals[VAL_CLK]);
+
+	return ret;
+}
+
+static int lg_bulk_split(void)
+{
+	struct lg *lg = ctx_cur->pgm.priv;
+
+	if (lg->split)
+		return 0;
+	lg->split = 1;
+
+	gpiod_line_release_bulk(&lg->all_bulk);
+
+	return lg_request_split();
+}
+
+static int lg_bulk_join(void)
+{
+	struct lg *lg = ctx_cur->pgm.priv;
+
+	if (!lg->split)
+		return 0;
+	lg->split = 0;
+
+	gpiod_line_release_bulk(&lg->dat_bulk);
+	gpiod_line_release_bulk(&lg->ctl_bulk);
+
+	memset(lg->vals, 0, lg->num_dat * sizeof(*lg->vals));
+
+	return gpiod_line_request_bulk_output(&lg->all_bulk, CONSUMER, lg->vals);
+}
+
+static int lg_init(const char *arg)
+{
+	struct lg *lg;
+	char name[64];
+	int ret;
+
+	lg = calloc(1, sizeof(*lg));
+	if (!lg)
+		return -ENOMEM;
+	lg->can_reconfig = 1;
+	ctx_cur->pgm.priv = lg;
+
+	ret = lg_parse_args(arg, name, sizeof(name));
+	if (ret < 0)
+		goto out;
+
+	lg->chip = gpiod_chip_open_by_name(name);
+	if (!lg->chip) {
+		log_err("Open chip failed\n");
+		ret = -ENOENT;
+		goto out;
+	}
+
+	lg->num_dat = pgm_num_targets();
+	gpiod_line_bulk_init(&lg->dat_bulk);
+	for (int i = 0; i < lg->num_dat; i++) {
+		struct gpiod_line *line = gpiod_chip_get_line(lg->chip, pgm_dat_gpios()[i]);
+
+		if (!line) {
+			log_err("Error getting required GPIO lines!\n");
+			goto err;
+		}
+		gpiod_line_bulk_add(&lg->dat_bulk, line);
+	}
+
+	lg->rst_line = gpiod_chip_get_line(lg->chip, pgm_rst_gpio());
+	lg->clk_line = gpiod_chip_get_line(lg->chip, pgm_clk_gpio());
+	if (!lg->clk_line || !lg->rst_line) {
+		log_err("Error getting required GPIO lines!\n");
+		goto err;
+	}
+
+	if (lg->bulk) {
+		/* DAT lines first, gpiod_line_get_value_bulk() maps by position */
+		gpiod_line_bulk_init(&lg->all_bulk);
+		for (int i = 0; i < lg->num_dat; i++)
+			gpiod_line_bulk_add(&lg->all_bulk, lg->dat_bulk.lines[i]);
+		gpiod_line_bulk_add(&lg->all_bulk, lg->clk_line);
+		gpiod_line_bulk_add(&lg->all_bulk, lg->rst_line);
+		gpiod_line_bulk_init(&lg->ctl_bulk);
+		gpiod_line_bulk_add(&lg->ctl_bulk, lg->clk_line);
+		gpiod_line_bulk_add(&lg->ctl_bulk, lg->rst_line);
+
+		/* start out like the per-line mode, DAT as input */
+		memset(lg->vals, 0, sizeof(lg->vals));
+		lg->split = 1;
+		ret = lg_request_split();
+	} else {
+		ret = gpiod_line_request_bulk_input(&lg->dat_bulk, CONSUMER);
+		ret |= gpiod_line_request_output(lg->rst_line, CONSUMER, 0);
+		ret |= gpiod_line_request_output(lg->clk_line, CONSUMER, 0);
+	}
+	if (ret < 0) {
+		log_err("Request line as output failed\n");
+		goto err;
+	}
+
+	timing_init();
+
+	return 0;
+
+err:
+	/* releases whatever lines were requested as well */
+	gpiod_chip_close(lg->chip);
+	ret = -ENOENT;
+out:
+	free(lg);
+	ctx_cur->pgm.priv = NULL;
+	return ret;
+}
+
+/* push the shadow values of bulk mode out with one ioctl */
+static void lg_bulk_flush(void)
+{
+	struct lg *lg = ctx_cur->pgm.priv;
+	int ret;
+
+	if (lg->split)
+		ret = gpiod_line_set_value_bulk(&lg->ctl_bulk, &lg->vals[VAL_CLK]);
+	else
+		ret = gpiod_line_set_value_bulk(&lg->all_bulk, lg->vals);
+
+	if (ret < 0)
+		log_err("Setting lines failed\n");
+}
+
+static void lg_set_dats(uint32_t dats)
+{
+	struct lg *lg = ctx_cur->pgm.priv;
+
+	for (int i = 0; i < lg->num_dat; i++)
+		lg->vals[i] = (dats >> i) & 1;
+
+	if (lg->bulk) {
+		lg_bulk_flush();
+		return;
+	}
+
+	if (gpiod_line_set_value_bulk(&lg->dat_bulk, lg->vals) < 0)
+		log_err("Setting data line failed\n");
+}
+
+static uint32_t lg_get_dats(void)
+{
+	struct lg *lg = ctx_cur->pgm.priv;
+	int dats[PGM_MAX_TARGETS];
+	uint32_t ret = 0;
+
+	if (gpiod_line_get_value_bulk(&lg->dat_bulk, dats) < 0) {
+		log_err("Getting data line failed\n");
+		return 0;
+	}
+
+	for (int i = 0; i < lg->num_dat; i++)
+		ret |= dats[i] << i;
+
+	return ret;
+}
+
+static void lg_set_rst(int val)
+{
+	struct lg *lg = ctx_cur->pgm.priv;
+
+	lg->vals[VAL_RST] = val;
+
+	if (lg->bulk) {
+		lg_bulk_flush();
+		return;
+	}
+
+	if (gpiod_line_set_value(lg->rst_line, val) < 0)
+		log_err("Setting reset line failed\n");
+}
+
+static void lg_set_clk(int val)
+{
+	struct lg *lg = ctx_cur->pgm.priv;
+
+	lg->vals[VAL_CLK] = val;
+
+	if (lg->bulk) {
+		lg_bulk_flush();
+		return;
+	}
+
+	if (gpiod_line_set_value(lg->clk_line, val) < 0)
+		log_err("Setting clock line failed\n");
+}
+
+static void lg_set_lines(unsigned int mask, unsigned int lines)
+{
+	struct lg *lg = ctx_cur->pgm.priv;
+	uint32_t dats = lines & PGM_DAT ? (1U << lg->num_dat) - 1 : 0;
+
+	if (!lg->bulk) {
+		if ((mask & PGM_CLK) && !(lines & PGM_CLK))
+			lg_set_clk(0);
+		if (mask & PGM_DAT)
+			lg_set_dats(dats);
+		if (mask & PGM_RST)
+			lg_set_rst(!!(lines & PGM_RST));
+		if ((mask & PGM_CLK) && (lines & PGM_CLK))
+			lg_set_clk(1);
+		return;
+	}
+
+	/*
+	 * The kernel updates the lines of a handle in request order, DAT
+	 * first. That is fine for a falling edge, the target sampled on the
+	 * rising one, but a rising edge has to wait for the data.
+	 */
+	if (mask & PGM_DAT) {
+		for (int i = 0; i < lg->num_dat; i++)
+			lg->vals[i] = (dats >> i) & 1;
+	}
+	if (mask & PGM_RST)
+		lg->vals[VAL_RST] = !!(lines & PGM_RST);
+	if ((mask & PGM_CLK) && (lines & PGM_CLK) && (mask & ~PGM_CLK))
+		lg_bulk_flush();
+	if (mask & PGM_CLK)
+		lg->vals[VAL_CLK] = !!(lines & PGM_CLK);
+
+	lg_bulk_flush();
+}
+
+static void lg_dat_dir(int state)
+{
+	struct lg *lg = ctx_cur->pgm.priv;
+	int zeros[PGM_MAX_TARGETS] = { 0 };
+	int ret = -1;
+
+	if (lg->bulk) {
+		ret = state ? lg_bulk_join() : lg_bulk_split();
+		if (ret < 0)
+			log_err("Setting data directions failed\n");
+		return;
+	}
+
+	if (lg->can_reconfig) {
+		ret = lg_set_direction(state, zeros);
+
+		/* kernels before 5.5 lack the ioctl, re-request from now on */
+		if (ret < 0 && (errno == EINVAL || errno == ENOTTY))
+			lg->can_reconfig = 0;
+		else if (ret < 0)
+			log_err("Setting data directions failed\n");
+	}
+
+	if (lg->can_reconfig)
+		return;
+
+	gpiod_line_release_bulk(&lg->dat_bulk);
+
+	if (state)
+		ret = gpiod_line_request_bulk_output(&lg->dat_bulk, CONSUMER, zeros);
+	else
+		ret = gpiod_line_request_bulk_input(&lg->dat_bulk, CONSUMER);
+
+	if (ret < 0)
+		log_err("Setting data directions failed\n");
+}
+
+static void lg_usleep(unsigned int usec)
+{
+	timing_delay_us(usec);
+}
+
+static void lg_deinit(void)
+{
+	struct lg *lg = ctx_cur->pgm.priv;
+
+	gpiod_chip_close(lg->chip);
+	free(lg);
+	ctx_cur->pgm.priv = NULL;
+	timing_print_stats();
+}
+
+const struct pgm_backend pgm_gpiod_backend = {
+	.name		= "gpiod",
+	.help		= "libgpiod character device [:<gpiochip>,bulk]",
+	.init		= lg_init,
+	.deinit		= lg_deinit,
+	.set_dats	= lg_set_dats,
+	.get_dats	= lg_get_dats,
+	.set_rst	= lg_set_rst,
+	.set_clk	= lg_set_clk,
+	.set_lines	= lg_set_lines,
+	.dat_dir	= lg_dat_dir,
+	.usleep		= lg_usleep,
+};
@@ -0,0 +1,323 @@
+/*
+ * nuvoicp - memory mapped BCM283x/BCM2711 GPIO register backend
+ *
+ * Drives the ICP lines by writing GPSET0/GPCLR0 and reading GPLEV0 in the
+ * register block exposed by /dev/gpiomem, one store per edge instead of
+ * one ioctl. Only works on the RPi 1-4 GPIO block, the RPi 5 RP1 uses a
+ * different register layout.
+ *
+ * Backend arguments, comma separated:
+ *   <path>     register page to map (default /dev/gpiomem). A regular
+ *              file is treated as a fake register page: GPSET0/GPCLR0
+ *              writes are mirrored into GPLEV0 so the file can be
+ *              inspected afterwards.
+ *   spin=<n>   extra GPLEV0 reads after every clock edge, to slow the
+ *              ICP clock down for long wires
+ *
+ * Distributed under the same terms as nuvoicp.c, see there.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "pgm.h"
+#include "timing.h"
+#include "log.h"
+#include "ctx.h"
+
+#define GPIOMEM_DEFAULT_PATH	"/dev/gpiomem"
+#define GPIOMEM_BLOCK_SIZE	4096
+
+/* register word offsets */
+#define GPFSEL0			0
+#define GPSET0			7
+#define GPCLR0			10
+#define GPLEV0			13
+
+#define GPFSEL_INPUT		0
+#define GPFSEL_OUTPUT		1
+
+/* per context, in ctx_cur->pgm.priv */
+struct gpiomem {
+	volatile uint32_t *gpio;
+	int gpio_fd;
+	int fake;
+	unsigned int spin;
+	char *reg_path;
+
+	/* GPLEV0/GPSET0/GPCLR0 bits of the DAT lines, one per target */
+	uint32_t dat_mask;
+	int dat_pins[PGM_MAX_TARGETS], num_dat;
+	int clk_pin, rst_pin;
+};
+
+/* GPFSEL registers hold ten pins each, other contexts share them */
+static pthread_mutex_t fsel_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void gpiomem_fsel(int pin, int mode)
+{
+	struct gpiomem *gm = ctx_cur->pgm.priv;
+	volatile uint32_t *reg = &gm->gpio[GPFSEL0 + pin / 10];
+	int shift = (pin % 10) * 3;
+
+	pthread_mutex_lock(&fsel_lock);
+	*reg = (*reg & ~(7 << shift)) | (mode << shift);
+	pthread_mutex_unlock(&fsel_lock);
+}
+
+static void gpiomem_update(uint32_t set, uint32_t clr)
+{
+	struct gpiomem *gm = ctx_cur->pgm.priv;
+
+	if (clr)
+		gm->gpio[GPCLR0] = clr;
+	if (set)
+		gm->gpio[GPSET0] = set;
+
+	/* nothing but us updates the level register of a fake page */
+	if (gm->fake)
+		gm->gpio[GPLEV0] = (gm->gpio[GPLEV0] & ~clr) | set;
+}
+
+static void gpiomem_write(int pin, int val)
+{
+	if (val)
+		gpiomem_update(1U << pin, 0);
+	else
+		gpiomem_update(0, 1U << pin);
+}
+
+/* spread one bit per target onto the DAT pins */
+static uint32_t gpiomem_dat_bits(uint32_t vals)
+{
+	struct gpiomem *gm = ctx_cur->pgm.priv;
+	uint32_t bits = 0;
+
+	for (int i = 0; i < gm->num_dat; i++)
+		bits |= ((vals >> i) & 1) << gm->dat_pins[i];
+
+	return bits;
+}
+
+static int gpiomem_parse_args(const char *arg)
+{
+	struct gpiomem *gm = ctx_cur->pgm.priv;
+	char *args, *opt, *save = NULL;
+	int ret = 0;
+
+	if (!arg)
+		return 0;
+
+	args = strdup(arg);
+	for (opt = strtok_r(args, ",", &save); opt; opt = strtok_r(NULL, ",", &save)) {
+		if (!strncmp(opt, "spin=", 5)) {
+			gm->spin = strtoul(opt + 5, NULL, 0);
+		} else if (!strchr(opt, '=')) {
+			free(gm->reg_path);
+			gm->reg_path = strdup(opt);
+		} else {
+			log_err("gpiomem: bad backend argument '%s'\n", opt);
+			ret = -EINVAL;
+			break;
+		}
+	}
+
+	free(args);
+	return ret;
+}
+
+static void gpiomem_free(struct gpiomem *gm)
+{
+	free(gm->reg_path);
+	free(gm);
+	ctx_cur->pgm.priv = NULL;
+}
+
+static int gpiomem_init(const char *arg)
+{
+	struct gpiomem *gm;
+	const char *path;
+	struct stat st;
+	int ret;
+
+	gm = calloc(1, sizeof(*gm));
+	if (!gm)
+		return -ENOMEM;
+	gm->gpio_fd = -1;
+	ctx_cur->pgm.priv = gm;
+
+	ret = gpiomem_parse_args(arg);
+	if (ret < 0)
+		goto err;
+	path = gm->reg_path ? gm->reg_path : GPIOMEM_DEFAULT_PATH;
+
+	gm->clk_pin = pgm_clk_gpio();
+	gm->rst_pin = pgm_rst_gpio();
+	gm->num_dat = pgm_num_targets();
+	for (int i = 0; i < gm->num_dat; i++) {
+		gm->dat_pins[i] = pgm_dat_gpios()[i];
+		if (gm->dat_pins[i] < 0 || gm->dat_pins[i] > 31)
+			goto bad_pin;
+		gm->dat_mask |= 1U << gm->dat_pins[i];
+	}
+	if (gm->clk_pin < 0 || gm->clk_pin > 31 || gm->rst_pin < 0 || gm->rst_pin > 31)
+		goto bad_pin;
+
+	/* an explicit path may name a fake page that does not exist yet */
+	gm->gpio_fd = open(path, O_RDWR | O_SYNC | (gm->reg_path ? O_CREAT : 0), 0644);
+	if (gm->gpio_fd < 0) {
+		log_err("Opening %s failed: %s\n", path, strerror(errno));
+		ret = -ENOENT;
+		goto err;
+	}
+
+	fstat(gm->gpio_fd, &st);
+	gm->fake = S_ISREG(st.st_mode);
+	if (gm->fake && st.st_size < GPIOMEM_BLOCK_SIZE &&
+	    ftruncate(gm->gpio_fd, GPIOMEM_BLOCK_SIZE) < 0) {
+		log_err("Resizing fake register page failed\n");
+		ret = -EIO;
+		goto err;
+	}
+
+	gm->gpio = mmap(NULL, GPIOMEM_BLOCK_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED,
+			gm->gpio_fd, 0);
+	if (gm->gpio == MAP_FAILED) {
+		log_err("Mapping %s failed: %s\n", path, strerror(errno));
+		ret = -ENOENT;
+		goto err;
+	}
+
+	gpiomem_write(gm->rst_pin, 0);
+	gpiomem_write(gm->clk_pin, 0);
+	gpiomem_fsel(gm->rst_pin, GPFSEL_OUTPUT);
+	gpiomem_fsel(gm->clk_pin, GPFSEL_OUTPUT);
+	for (int i = 0; i < gm->num_dat; i++)
+		gpiomem_fsel(gm->dat_pins[i], GPFSEL_INPUT);
+
+	timing_init();
+
+	return 0;
+
+bad_pin:
+	log_err("gpiomem: only GPIO 0-31 are supported\n");
+	ret = -EINVAL;
+err:
+	if (gm->gpio_fd >= 0)
+		close(gm->gpio_fd);
+	gpiomem_free(gm);
+	return ret;
+}
+
+static void gpiomem_set_dats(uint32_t vals)
+{
+	struct gpiomem *gm = ctx_cur->pgm.priv;
+	uint32_t bits = gpiomem_dat_bits(vals);
+
+	gpiomem_update(bits, gm->dat_mask & ~bits);
+}
+
+static uint32_t gpiomem_get_dats(void)
+{
+	struct gpiomem *gm = ctx_cur->pgm.priv;
+	uint32_t lev = gm->gpio[GPLEV0];
+	uint32_t vals = 0;
+
+	for (int i = 0; i < gm->num_dat; i++)
+		vals |= ((lev >> gm->dat_pins[i]) & 1) << i;
+
+	return vals;
+}
+
+static void gpiomem_set_rst(int val)
+{
+	struct gpiomem *gm = ctx_cur->pgm.priv;
+
+	gpiomem_write(gm->rst_pin, val);
+}
+
+static void gpiomem_set_clk(int val)
+{
+	struct gpiomem *gm = ctx_cur->pgm.priv;
+
+	gpiomem_write(gm->clk_pin, val);
+
+	for (unsigned int i = 0; i < gm->spin; i++)
+		(void)gm->gpio[GPLEV0];
+}
+
+static void gpiomem_set_lines(unsigned int mask, unsigned int vals)
+{
+	struct gpiomem *gm = ctx_cur->pgm.priv;
+	const uint32_t pins[] = { gm->dat_mask, 1U << gm->clk_pin, 1U << gm->rst_pin };
+	uint32_t set = 0, clr = 0;
+
+	for (int i = 0; i < 3; i++) {
+		if (!(mask & (1 << i)))
+			continue;
+		if (vals & (1 << i))
+			set |= pins[i];
+		else
+			clr |= pins[i];
+	}
+
+	/* clears first and a rising CLK edge last, data meets setup time */
+	uint32_t rise = set & (1U << gm->clk_pin);
+
+	gpiomem_update(set & ~rise, clr);
+	if (rise)
+		gpiomem_update(rise, 0);
+
+	if (mask & PGM_CLK) {
+		for (unsigned int i = 0; i < gm->spin; i++)
+			(void)gm->gpio[GPLEV0];
+	}
+}
+
+static void gpiomem_dat_dir(int state)
+{
+	struct gpiomem *gm = ctx_cur->pgm.priv;
+
+	if (state)
+		gpiomem_update(0, gm->dat_mask);
+	for (int i = 0; i < gm->num_dat; i++)
+		gpiomem_fsel(gm->dat_pins[i], state ? GPFSEL_OUTPUT : GPFSEL_INPUT);
+}
+
+static void gpiomem_usleep(unsigned int usec)
+{
+	timing_delay_us(usec);
+}
+
+static void gpiomem_deinit(void)
+{
+	struct gpiomem *gm = ctx_cur->pgm.priv;
+
+	munmap((void *)gm->gpio, GPIOMEM_BLOCK_SIZE);
+	close(gm->gpio_fd);
+	gpiomem_free(gm);
+	timing_print_stats();
+}
+
+const struct pgm_backend pgm_gpiomem_backend = {
+	.name		= "gpiomem",
+	.help		= "mmap()ed GPIO registers [:<path>,spin=<n>]",
+	.fallback	= "gpiod",
+	.init		= gpiomem_init,
+	.deinit		= gpiomem_deinit,
+	.set_dats	= gpiomem_set_dats,
+	.get_dats	= gpiomem_get_dats,
+	.set_rst	= gpiomem_set_rst,
+	.set_clk	= gpiomem_set_clk,
+	.set_lines	= gpiomem_set_lines,
+	.dat_dir	= gpiomem_dat_dir,
+	.usleep		= gpiomem_usleep,
+};
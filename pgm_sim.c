@@ -0,0 +1,687 @@
+/*
+ * nuvoicp - simulated MS51/N76E003 ICP target
+ *
+ * Runs the target side of the ICP protocol in-process: the entry key,
+ * the 24 bit command frames, the read/write byte handshakes and an
+ * APROM/LDROM/CFG flash model with page and mass erase. Time is virtual,
+ * every GPIO call costs a fixed amount and pgm_usleep() only advances the
+ * clock, so a full programming cycle finishes in well under a second while
+ * still reporting how long it would have taken on the wire.
+ *
+ * Backend arguments, comma separated:
+ *   flash=<file>  load the flash contents from <file>, save them back on exit
+ *   devid=<id>    device ID to report (default MS51FB9AE)
+ *   opns=<ns>     cost of one GPIO call in nanoseconds
+ *   bulk=<0|1>    charge multi-line sets as one call (default) or one per line
+ *   absent=<mask> targets that are not plugged in
+ *   units=<n>     a production line of n units: a unit is pulled once
+ *                 the host has not programmed or erased it for a second,
+ *                 the next one, blank and with its own UID, is plugged
+ *                 in a second later
+ *
+ * With gang programming every DAT line gets its own target, all of them
+ * share CLK and RST. The flash file of target n > 0 is <file>.<n>.
+ *
+ * Distributed under the same terms as nuvoicp.c, see there.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+
+#include "pgm.h"
+#include "log.h"
+#include "ctx.h"
+
+#define SIM_FLASH_MAX		(18 * 1024)
+#define SIM_PAGE_SIZE		128
+#define SIM_CFG_ADDR		0x30000
+#define SIM_CFG_SIZE		SIM_PAGE_SIZE
+
+#define SIM_ENTRY_KEY		0x5aa503
+#define SIM_MASS_ERASE_KEY	0x3a5a5
+
+#define SIM_CID			0xda
+#define SIM_N76E003_DEVID	0x3650
+#define SIM_MS51FB9AE_DEVID	0x4b21
+
+/* ICP command codes as seen by the target, the low 6 bits of a frame */
+#define SIM_CMD_READ_FLASH	0x00
+#define SIM_CMD_READ_UID	0x04
+#define SIM_CMD_READ_CID	0x0b
+#define SIM_CMD_READ_DEVICE_ID	0x0c
+#define SIM_CMD_WRITE_FLASH	0x21
+#define SIM_CMD_PAGE_ERASE	0x22
+#define SIM_CMD_MASS_ERASE	0x26
+
+/* minimum flash operation times, in the range of the datasheet figures */
+#define SIM_T_PROG_NS		(25 * 1000ULL)
+#define SIM_T_PAGE_ERASE_NS	(5 * 1000 * 1000ULL)
+#define SIM_T_MASS_ERASE_NS	(50 * 1000 * 1000ULL)
+
+/* timing calibration aborts writes on purpose, do not flood the terminal */
+#define SIM_VIOLATIONS_SHOWN	8
+
+/* operator of the units=<n> line, see sim_line() */
+#define SIM_PULL_NS		(1000 * 1000 * 1000ULL)
+#define SIM_PLUG_NS		(1000 * 1000 * 1000ULL)
+
+/* default cost of one GPIO call, about one libgpiod ioctl on a RPi 4 */
+#define SIM_DEFAULT_OP_NS	1000
+
+enum sim_state { SIM_RESET, SIM_ENTRY, SIM_CMD, SIM_READ, SIM_WRITE };
+enum sim_op { SIM_OP_PROG, SIM_OP_PAGE_ERASE, SIM_OP_MASS_ERASE };
+
+struct sim_target {
+	uint8_t flash[SIM_FLASH_MAX];
+	uint8_t cfg[SIM_CFG_SIZE];
+	uint8_t uid[12];
+	uint8_t ucid[4];
+	uint16_t devid;
+	int flash_size;
+
+	enum sim_state state;
+	uint32_t shift;		/* bits clocked in from the host */
+	int nbits;		/* bits of the current frame or byte */
+	uint8_t cmd;
+	uint32_t addr;
+	uint8_t byte;		/* byte being shifted out on reads */
+	int end;		/* end bit latched on the 9th clock */
+	enum sim_op op;
+	uint64_t t_start;	/* time the last data bit was clocked */
+	int present;
+	uint64_t t_line;	/* last program/erase, or pull, for units=<n> */
+
+	uint64_t commands;
+	uint64_t bad_commands;
+	uint64_t bytes_read;
+	uint64_t bytes_written;
+	uint64_t page_erases;
+	uint64_t mass_erases;
+	uint64_t violations;
+};
+
+struct sim_stats {
+	uint64_t calls;
+	uint64_t clk_pulses;
+	uint64_t dat_edges;
+	uint64_t rst_edges;
+	uint64_t dir_switches;
+	uint64_t sleep_ns;
+};
+
+/* per context, in ctx_cur->pgm.priv */
+struct sim {
+	struct sim_target targets[PGM_MAX_TARGETS];
+	int num_targets;
+	struct sim_stats stats;
+
+	/* host side of the lines, one DAT bit per target */
+	uint32_t host_dats;
+	int host_dat_out, host_clk, host_rst;
+
+	uint64_t now_ns;
+	uint64_t op_ns;
+	int bulk;
+	char *flash_file;
+	uint32_t absent;
+	uint16_t devid;
+	int line_units, line_plugged;
+};
+
+static void sim_tick(void)
+{
+	struct sim *sim = ctx_cur->pgm.priv;
+
+	sim->stats.calls++;
+	sim->now_ns += sim->op_ns;
+}
+
+static uint8_t sim_mem_read(struct sim_target *t, uint32_t addr)
+{
+	if (addr < t->flash_size)
+		return t->flash[addr];
+	if (addr >= SIM_CFG_ADDR && addr < SIM_CFG_ADDR + SIM_CFG_SIZE)
+		return t->cfg[addr - SIM_CFG_ADDR];
+	return 0xff;
+}
+
+static void sim_mem_program(struct sim_target *t, uint32_t addr, uint8_t val)
+{
+	/* programming can only clear bits */
+	if (addr < t->flash_size)
+		t->flash[addr] &= val;
+	else if (addr >= SIM_CFG_ADDR && addr < SIM_CFG_ADDR + SIM_CFG_SIZE)
+		t->cfg[addr - SIM_CFG_ADDR] &= val;
+}
+
+static void sim_page_erase(struct sim_target *t, uint32_t addr)
+{
+	addr &= ~(SIM_PAGE_SIZE - 1);
+
+	if (addr < t->flash_size)
+		memset(&t->flash[addr], 0xff, SIM_PAGE_SIZE);
+	else if (addr == SIM_CFG_ADDR)
+		memset(t->cfg, 0xff, SIM_CFG_SIZE);
+}
+
+static uint8_t sim_load_byte(struct sim_target *t)
+{
+	switch (t->cmd) {
+	case SIM_CMD_READ_CID:
+		return t->addr ? 0xff : SIM_CID;
+	case SIM_CMD_READ_DEVICE_ID:
+		if (t->addr > 1)
+			return 0xff;
+		return t->devid >> (8 * t->addr);
+	case SIM_CMD_READ_UID:
+		if (t->addr < sizeof(t->uid))
+			return t->uid[t->addr];
+		if (t->addr >= 0x20 && t->addr < 0x20 + sizeof(t->ucid))
+			return t->ucid[t->addr - 0x20];
+		return 0xff;
+	default:
+		return sim_mem_read(t, t->addr);
+	}
+}
+
+static void sim_decode(struct sim_target *t, uint32_t frame)
+{
+	struct sim *sim = ctx_cur->pgm.priv;
+
+	t->cmd = frame & 0x3f;
+	t->addr = frame >> 6;
+	t->nbits = 0;
+	t->commands++;
+
+	switch (t->cmd) {
+	case SIM_CMD_READ_FLASH:
+	case SIM_CMD_READ_UID:
+	case SIM_CMD_READ_CID:
+	case SIM_CMD_READ_DEVICE_ID:
+		t->byte = sim_load_byte(t);
+		t->state = SIM_READ;
+		break;
+	case SIM_CMD_WRITE_FLASH:
+		t->op = SIM_OP_PROG;
+		t->state = SIM_WRITE;
+		break;
+	case SIM_CMD_PAGE_ERASE:
+		t->op = SIM_OP_PAGE_ERASE;
+		t->state = SIM_WRITE;
+		break;
+	case SIM_CMD_MASS_ERASE:
+		if (t->addr == SIM_MASS_ERASE_KEY) {
+			t->op = SIM_OP_MASS_ERASE;
+			t->state = SIM_WRITE;
+			break;
+		}
+		/* fall through */
+	default:
+		log_info("sim%d: unknown ICP frame 0x%06x\n",
+			(int)(t - sim->targets), frame);
+		t->bad_commands++;
+		break;
+	}
+}
+
+/* the 9th clock of a write/erase handshake, see icp_write_byte() */
+static void sim_commit(struct sim_target *t)
+{
+	struct sim *sim = ctx_cur->pgm.priv;
+
+	static const uint64_t t_min[] = {
+		[SIM_OP_PROG]		= SIM_T_PROG_NS,
+		[SIM_OP_PAGE_ERASE]	= SIM_T_PAGE_ERASE_NS,
+		[SIM_OP_MASS_ERASE]	= SIM_T_MASS_ERASE_NS,
+	};
+
+	if (sim->now_ns - t->t_start < t_min[t->op]) {
+		if (t->violations < SIM_VIOLATIONS_SHOWN)
+			log_info("sim%d: %s at 0x%05x aborted after %llu us\n",
+				(int)(t - sim->targets), t->op == SIM_OP_PROG ? "program" : "erase",
+				t->addr, (unsigned long long)(sim->now_ns - t->t_start) / 1000);
+		else if (t->violations == SIM_VIOLATIONS_SHOWN)
+			log_info("sim%d: more aborted writes, only counted\n",
+				(int)(t - sim->targets));
+		t->violations++;
+		return;
+	}
+
+	t->t_line = sim->now_ns;
+
+	switch (t->op) {
+	case SIM_OP_PROG:
+		sim_mem_program(t, t->addr, t->shift & 0xff);
+		t->bytes_written++;
+		break;
+	case SIM_OP_PAGE_ERASE:
+		sim_page_erase(t, t->addr);
+		t->page_erases++;
+		break;
+	case SIM_OP_MASS_ERASE:
+		memset(t->flash, 0xff, sizeof(t->flash));
+		memset(t->cfg, 0xff, sizeof(t->cfg));
+		t->mass_erases++;
+		break;
+	}
+}
+
+static void sim_clk_rise(struct sim_target *t, int dat)
+{
+	switch (t->state) {
+	case SIM_RESET:
+		break;
+	case SIM_ENTRY:
+		t->shift = ((t->shift << 1) | dat) & 0xffffff;
+		if (t->shift == SIM_ENTRY_KEY) {
+			t->state = SIM_CMD;
+			t->nbits = 0;
+		}
+		break;
+	case SIM_CMD:
+		t->shift = (t->shift << 1) | dat;
+		t->nbits++;
+		break;
+	case SIM_READ:
+		if (t->nbits == 8)
+			t->end = dat;
+		t->nbits++;
+		break;
+	case SIM_WRITE:
+		if (t->nbits < 8)
+			t->shift = (t->shift << 1) | dat;
+		else
+			t->end = dat;
+		t->nbits++;
+		break;
+	}
+}
+
+static void sim_clk_fall(struct sim_target *t)
+{
+	struct sim *sim = ctx_cur->pgm.priv;
+
+	switch (t->state) {
+	case SIM_CMD:
+		if (t->nbits == 24)
+			sim_decode(t, t->shift & 0xffffff);
+		break;
+	case SIM_READ:
+		if (t->nbits < 9)
+			break;
+		t->bytes_read++;
+		if (t->end) {
+			t->state = SIM_CMD;
+		} else {
+			t->addr++;
+			t->byte = sim_load_byte(t);
+		}
+		t->nbits = 0;
+		break;
+	case SIM_WRITE:
+		if (t->nbits == 8)
+			t->t_start = sim->now_ns;
+		if (t->nbits < 9)
+			break;
+		sim_commit(t);
+		if (t->end || t->op != SIM_OP_PROG)
+			t->state = SIM_CMD;
+		else
+			t->addr++;
+		t->nbits = 0;
+		break;
+	default:
+		break;
+	}
+}
+
+/* level the target drives on DAT, when it is driving at all */
+static int sim_target_dat(struct sim_target *t)
+{
+	if (t->present && t->state == SIM_READ && t->nbits < 8)
+		return (t->byte >> (7 - t->nbits)) & 1;
+
+	/* idle line is pulled up */
+	return 1;
+}
+
+static int sim_parse_args(const char *arg)
+{
+	struct sim *sim = ctx_cur->pgm.priv;
+	char *args, *opt, *save = NULL;
+	int ret = 0;
+
+	if (!arg)
+		return 0;
+
+	args = strdup(arg);
+	for (opt = strtok_r(args, ",", &save); opt; opt = strtok_r(NULL, ",", &save)) {
+		char *val = strchr(opt, '=');
+
+		if (!val) {
+			ret = -EINVAL;
+			break;
+		}
+		*val++ = '\0';
+
+		if (!strcmp(opt, "flash")) {
+			sim->flash_file = strdup(val);
+		} else if (!strcmp(opt, "devid")) {
+			sim->devid = strtoul(val, NULL, 0);
+		} else if (!strcmp(opt, "opns")) {
+			sim->op_ns = strtoull(val, NULL, 0);
+		} else if (!strcmp(opt, "bulk")) {
+			sim->bulk = atoi(val);
+		} else if (!strcmp(opt, "absent")) {
+			sim->absent = strtoul(val, NULL, 0);
+		} else if (!strcmp(opt, "units")) {
+			sim->line_units = atoi(val);
+		} else {
+			ret = -EINVAL;
+			break;
+		}
+	}
+
+	if (ret < 0)
+		log_err("sim: bad backend argument '%s'\n", opt);
+
+	free(args);
+	return ret;
+}
+
+static void sim_flash_file(int n, char *name, size_t len)
+{
+	struct sim *sim = ctx_cur->pgm.priv;
+
+	if (n)
+		snprintf(name, len, "%s.%d", sim->flash_file, n);
+	else
+		snprintf(name, len, "%s", sim->flash_file);
+}
+
+static int sim_init(const char *arg)
+{
+	struct sim *sim;
+	int ret;
+
+	sim = calloc(1, sizeof(*sim));
+	if (!sim)
+		return -ENOMEM;
+	sim->op_ns = SIM_DEFAULT_OP_NS;
+	sim->bulk = 1;
+	sim->devid = SIM_MS51FB9AE_DEVID;
+	ctx_cur->pgm.priv = sim;
+
+	ret = sim_parse_args(arg);
+	if (ret < 0) {
+		free(sim->flash_file);
+		free(sim);
+		ctx_cur->pgm.priv = NULL;
+		return ret;
+	}
+
+	sim->num_targets = pgm_num_targets();
+	for (int n = 0; n < sim->num_targets; n++) {
+		struct sim_target *t = &sim->targets[n];
+
+		memset(t, 0, sizeof(*t));
+		memset(t->flash, 0xff, sizeof(t->flash));
+		memset(t->cfg, 0xff, sizeof(t->cfg));
+		for (int i = 0; i < sizeof(t->uid); i++)
+			t->uid[i] = 0x10 + i;
+		t->uid[0] += n;
+		for (int i = 0; i < sizeof(t->ucid); i++)
+			t->ucid[i] = 0x40 + i;
+		t->devid = sim->devid;
+		t->flash_size = sim->devid == SIM_N76E003_DEVID ? 18 * 1024 : 16 * 1024;
+		t->present = !(sim->absent & (1 << n));
+
+		/* lines come up with RST held low */
+		t->state = SIM_ENTRY;
+
+		if (sim->flash_file) {
+			char name[256];
+			FILE *f;
+
+			sim_flash_file(n, name, sizeof(name));
+			f = fopen(name, "rb");
+			if (f) {
+				if (fread(t->flash, 1, sizeof(t->flash), f) != sizeof(t->flash) ||
+				    fread(t->cfg, 1, sizeof(t->cfg), f) != sizeof(t->cfg))
+					log_info("sim: short flash file, rest is erased\n");
+				fclose(f);
+			}
+		}
+	}
+
+	sim->host_dats = sim->host_clk = sim->host_rst = sim->host_dat_out = 0;
+	sim->now_ns = 0;
+	sim->line_plugged = sim->line_units ? 1 : 0;
+
+	return 0;
+}
+
+/*
+ * The units=<n> line: pull a unit the host is done with and plug in the
+ * next one, blank, with the unit number in the last UID byte and in ICP
+ * entry or reset as the RST line says. Runs while the host sleeps.
+ */
+static void sim_line(void)
+{
+	struct sim *sim = ctx_cur->pgm.priv;
+
+	for (int n = 0; sim->line_units && n < sim->num_targets; n++) {
+		struct sim_target *t = &sim->targets[n];
+
+		if (t->present && sim->now_ns - t->t_line >= SIM_PULL_NS) {
+			t->present = 0;
+			t->t_line = sim->now_ns;
+		} else if (!t->present && sim->line_plugged < sim->line_units &&
+			   sim->now_ns - t->t_line >= SIM_PLUG_NS) {
+			memset(t->flash, 0xff, sizeof(t->flash));
+			memset(t->cfg, 0xff, sizeof(t->cfg));
+			t->uid[sizeof(t->uid) - 1] = 0x1b + sim->line_plugged;
+			t->state = sim->host_rst ? SIM_RESET : SIM_ENTRY;
+			t->shift = 0;
+			t->nbits = 0;
+			t->present = 1;
+			t->t_line = sim->now_ns;
+			if (n == sim->num_targets - 1)
+				sim->line_plugged++;
+		}
+	}
+}
+
+static void sim_dats(uint32_t vals)
+{
+	struct sim *sim = ctx_cur->pgm.priv;
+
+	sim->stats.dat_edges += __builtin_popcount(vals ^ sim->host_dats);
+	sim->host_dats = vals;
+}
+
+static void sim_rst(int val)
+{
+	struct sim *sim = ctx_cur->pgm.priv;
+
+	if (val == sim->host_rst)
+		return;
+
+	sim->stats.rst_edges++;
+	sim->host_rst = val;
+
+	/* releasing reset leaves ICP mode, asserting it arms the entry key */
+	for (int n = 0; n < sim->num_targets; n++) {
+		struct sim_target *t = &sim->targets[n];
+
+		t->state = val ? SIM_RESET : SIM_ENTRY;
+		t->shift = 0;
+		t->nbits = 0;
+	}
+}
+
+static void sim_clk(int val)
+{
+	struct sim *sim = ctx_cur->pgm.priv;
+
+	if (val == sim->host_clk)
+		return;
+
+	sim->host_clk = val;
+	if (val)
+		sim->stats.clk_pulses++;
+
+	for (int n = 0; n < sim->num_targets; n++) {
+		struct sim_target *t = &sim->targets[n];
+
+		if (!t->present)
+			continue;
+		if (val)
+			sim_clk_rise(t, sim->host_dat_out ? (sim->host_dats >> n) & 1 : sim_target_dat(t));
+		else
+			sim_clk_fall(t);
+	}
+}
+
+static void sim_set_dats(uint32_t vals)
+{
+	sim_tick();
+	sim_dats(vals);
+}
+
+static uint32_t sim_get_dats(void)
+{
+	struct sim *sim = ctx_cur->pgm.priv;
+	uint32_t vals = 0;
+
+	sim_tick();
+	if (sim->host_dat_out)
+		return sim->host_dats;
+
+	for (int n = 0; n < sim->num_targets; n++)
+		vals |= sim_target_dat(&sim->targets[n]) << n;
+
+	return vals;
+}
+
+static void sim_set_rst(int val)
+{
+	sim_tick();
+	sim_rst(val);
+}
+
+static void sim_set_clk(int val)
+{
+	sim_tick();
+	sim_clk(val);
+}
+
+static void sim_set_lines(unsigned int mask, unsigned int vals)
+{
+	struct sim *sim = ctx_cur->pgm.priv;
+
+	if (sim->bulk) {
+		sim_tick();
+	} else {
+		for (unsigned int m = mask; m; m &= m - 1)
+			sim_tick();
+	}
+
+	/* same ordering as pgm_set_lines() */
+	if ((mask & PGM_CLK) && !(vals & PGM_CLK))
+		sim_clk(0);
+	if (mask & PGM_DAT)
+		sim_dats(vals & PGM_DAT ? (1U << sim->num_targets) - 1 : 0);
+	if (mask & PGM_RST)
+		sim_rst(!!(vals & PGM_RST));
+	if ((mask & PGM_CLK) && (vals & PGM_CLK))
+		sim_clk(1);
+}
+
+static void sim_dat_dir(int state)
+{
+	struct sim *sim = ctx_cur->pgm.priv;
+
+	sim_tick();
+	sim->stats.dir_switches++;
+	sim->host_dat_out = state;
+	if (state)
+		sim->host_dats = 0;
+}
+
+static void sim_usleep(unsigned int usec)
+{
+	struct sim *sim = ctx_cur->pgm.priv;
+
+	sim->now_ns += usec * 1000ULL;
+	sim->stats.sleep_ns += usec * 1000ULL;
+	sim_line();
+}
+
+static uint64_t sim_now_ns(void)
+{
+	struct sim *sim = ctx_cur->pgm.priv;
+
+	return sim->now_ns;
+}
+
+static void sim_deinit(void)
+{
+	struct sim *sim = ctx_cur->pgm.priv;
+	struct sim_target *t = &sim->targets[0];
+	uint64_t violations = 0;
+
+	for (int n = 0; sim->flash_file && n < sim->num_targets; n++) {
+		const struct sim_target *tn = &sim->targets[n];
+		char name[256];
+		FILE *f;
+
+		sim_flash_file(n, name, sizeof(name));
+		f = fopen(name, "wb");
+		if (!f || fwrite(tn->flash, 1, sizeof(tn->flash), f) != sizeof(tn->flash) ||
+		    fwrite(tn->cfg, 1, sizeof(tn->cfg), f) != sizeof(tn->cfg))
+			log_err("sim: saving flash to %s failed\n", name);
+		if (f)
+			fclose(f);
+	}
+	free(sim->flash_file);
+
+	for (int n = 0; n < sim->num_targets; n++)
+		violations += sim->targets[n].violations;
+
+	log_info("sim: %llu GPIO calls, %llu clock pulses, %llu DAT edges, "
+		"%llu RST edges, %llu direction switches\n",
+		(unsigned long long)sim->stats.calls, (unsigned long long)sim->stats.clk_pulses,
+		(unsigned long long)sim->stats.dat_edges, (unsigned long long)sim->stats.rst_edges,
+		(unsigned long long)sim->stats.dir_switches);
+	log_info("sim: %llu commands (%llu bad), %llu bytes read, %llu bytes "
+		"programmed, %llu page erases, %llu mass erases%s\n",
+		(unsigned long long)t->commands, (unsigned long long)t->bad_commands,
+		(unsigned long long)t->bytes_read, (unsigned long long)t->bytes_written,
+		(unsigned long long)t->page_erases, (unsigned long long)t->mass_erases,
+		sim->num_targets > 1 ? " per target" : "");
+	log_info("sim: %.6f s protocol time (%.6f s sleeping), "
+		"%llu timing violations\n",
+		sim->now_ns / 1e9, sim->stats.sleep_ns / 1e9, (unsigned long long)violations);
+
+	free(sim);
+	ctx_cur->pgm.priv = NULL;
+}
+
+const struct pgm_backend pgm_sim_backend = {
+	.name		= "sim",
+	.help		= "simulated target [:flash=<file>,devid=<id>,opns=<ns>,bulk=<0|1>,absent=<mask>,units=<n>]",
+	.init		= sim_init,
+	.deinit		= sim_deinit,
+	.set_dats	= sim_set_dats,
+	.get_dats	= sim_get_dats,
+	.set_rst	= sim_set_rst,
+	.set_clk	= sim_set_clk,
+	.set_lines	= sim_set_lines,
+	.dat_dir	= sim_dat_dir,
+	.usleep		= sim_usleep,
+	.now_ns		= sim_now_ns,
+};
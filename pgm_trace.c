@@ -0,0 +1,282 @@
+/*
+ * nuvoicp - VCD trace of the ICP lines
+ *
+ * Sits between the dispatch in pgm.c and the selected backend and records
+ * every change of CLK, RST, the DAT direction and the DAT lines into a
+ * buffer allocated and faulted in up front, so tracing adds no syscalls
+ * or page faults to the timed paths. DAT is what the host drives while
+ * it is an output and what it samples while it is an input, in between
+ * it is 'z'. At exit the buffer is written out as a VCD file for GTKWave
+ * and the like.
+ *
+ * Timestamps are CLOCK_MONOTONIC, or the backend's own clock if it has
+ * one, the virtual time of the simulator.
+ *
+ * Distributed under the same terms as nuvoicp.c, see there.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+
+#include "pgm.h"
+#include "timing.h"
+#include "log.h"
+#include "ctx.h"
+
+/* 16 bytes each, about the line changes of two full 16 KB programming runs */
+#define TRACE_MAX_EVENTS	(2 * 1024 * 1024)
+
+/* line state bits of an event */
+#define TRACE_CLK		(1 << 0)
+#define TRACE_RST		(1 << 1)
+#define TRACE_OUT		(1 << 2)	/* host drives DAT */
+#define TRACE_DAT_SHIFT		8		/* DAT level, one bit per target */
+#define TRACE_Z_SHIFT		16		/* DAT released and not sampled yet */
+#define TRACE_DAT_MASK		(((1U << PGM_MAX_TARGETS) - 1) << TRACE_DAT_SHIFT)
+#define TRACE_Z_MASK		(((1U << PGM_MAX_TARGETS) - 1) << TRACE_Z_SHIFT)
+
+struct trace_event {
+	uint64_t t_ns;
+	uint32_t lines;
+};
+
+/* per context, in ctx_cur->pgm.trace */
+struct trace {
+	const struct pgm_backend *inner;
+	struct pgm_backend backend;
+	const char *path;
+	int num_dats;
+
+	struct trace_event *events;
+	uint32_t num_events, dropped;
+	uint32_t lines;
+	uint32_t host_dats;
+};
+
+static uint64_t trace_now(void)
+{
+	struct trace *tr = ctx_cur->pgm.trace;
+
+	return tr->inner->now_ns ? tr->inner->now_ns() : timing_now_ns();
+}
+
+static void trace_record(uint32_t new_lines)
+{
+	struct trace *tr = ctx_cur->pgm.trace;
+
+	if (new_lines == tr->lines)
+		return;
+	tr->lines = new_lines;
+
+	if (tr->num_events == TRACE_MAX_EVENTS) {
+		tr->dropped++;
+		return;
+	}
+	tr->events[tr->num_events].t_ns = trace_now();
+	tr->events[tr->num_events].lines = new_lines;
+	tr->num_events++;
+}
+
+static uint32_t trace_dats(uint32_t l, uint32_t dats)
+{
+	return (l & ~(TRACE_DAT_MASK | TRACE_Z_MASK)) | (dats << TRACE_DAT_SHIFT);
+}
+
+static void trace_set_dats(uint32_t vals)
+{
+	struct trace *tr = ctx_cur->pgm.trace;
+
+	tr->inner->set_dats(vals);
+	tr->host_dats = vals;
+	trace_record(trace_dats(tr->lines, vals));
+}
+
+static uint32_t trace_get_dats(void)
+{
+	struct trace *tr = ctx_cur->pgm.trace;
+	uint32_t vals = tr->inner->get_dats();
+
+	if (!(tr->lines & TRACE_OUT))
+		trace_record(trace_dats(tr->lines, vals & ((1U << tr->num_dats) - 1)));
+	return vals;
+}
+
+static void trace_set_rst(int val)
+{
+	struct trace *tr = ctx_cur->pgm.trace;
+
+	tr->inner->set_rst(val);
+	trace_record(val ? tr->lines | TRACE_RST : tr->lines & ~TRACE_RST);
+}
+
+static void trace_set_clk(int val)
+{
+	struct trace *tr = ctx_cur->pgm.trace;
+
+	tr->inner->set_clk(val);
+	trace_record(val ? tr->lines | TRACE_CLK : tr->lines & ~TRACE_CLK);
+}
+
+/* a single call never has CLK fall and rise, so one event covers it */
+static void trace_set_lines(unsigned int mask, unsigned int vals)
+{
+	struct trace *tr = ctx_cur->pgm.trace;
+	uint32_t l = tr->lines;
+
+	tr->inner->set_lines(mask, vals);
+
+	if (mask & PGM_DAT) {
+		tr->host_dats = vals & PGM_DAT ? (1U << tr->num_dats) - 1 : 0;
+		l = trace_dats(l, tr->host_dats);
+	}
+	if (mask & PGM_RST)
+		l = vals & PGM_RST ? l | TRACE_RST : l & ~TRACE_RST;
+	if (mask & PGM_CLK)
+		l = vals & PGM_CLK ? l | TRACE_CLK : l & ~TRACE_CLK;
+	trace_record(l);
+}
+
+static void trace_dat_dir(int state)
+{
+	struct trace *tr = ctx_cur->pgm.trace;
+
+	tr->inner->dat_dir(state);
+
+	if (state)
+		trace_record(trace_dats(tr->lines | TRACE_OUT, tr->host_dats));
+	else
+		trace_record((tr->lines & ~(TRACE_OUT | TRACE_DAT_MASK)) |
+			     (((1U << tr->num_dats) - 1) << TRACE_Z_SHIFT));
+}
+
+static void vcd_value(FILE *f, uint32_t l, int bit, int z_bit, char id)
+{
+	if (z_bit >= 0 && (l & (1U << z_bit)))
+		fprintf(f, "z%c\n", id);
+	else
+		fprintf(f, "%d%c\n", !!(l & (1U << bit)), id);
+}
+
+/* variable ids: '!' CLK, '"' RST, '#' DAT direction, '$' onwards DAT */
+static void vcd_changes(FILE *f, uint32_t prev, uint32_t l, int all)
+{
+	struct trace *tr = ctx_cur->pgm.trace;
+
+	if (all || ((prev ^ l) & TRACE_CLK))
+		vcd_value(f, l, 0, -1, '!');
+	if (all || ((prev ^ l) & TRACE_RST))
+		vcd_value(f, l, 1, -1, '"');
+	if (all || ((prev ^ l) & TRACE_OUT))
+		vcd_value(f, l, 2, -1, '#');
+	for (int n = 0; n < tr->num_dats; n++) {
+		uint32_t m = (1U << (TRACE_DAT_SHIFT + n)) | (1U << (TRACE_Z_SHIFT + n));
+
+		if (all || ((prev ^ l) & m))
+			vcd_value(f, l, TRACE_DAT_SHIFT + n, TRACE_Z_SHIFT + n, '$' + n);
+	}
+}
+
+static int vcd_write(const char *path)
+{
+	struct trace *tr = ctx_cur->pgm.trace;
+	const int *gpios = pgm_dat_gpios();
+	uint64_t t0 = tr->num_events ? tr->events[0].t_ns : 0;
+	uint32_t prev = 0;
+	time_t now = time(NULL);
+	FILE *f;
+
+	f = fopen(path, "w");
+	if (!f) {
+		log_err("Writing trace to %s failed\n", path);
+		return -1;
+	}
+
+	fprintf(f, "$date %.24s $end\n", ctime(&now));
+	fprintf(f, "$version nuvoicp, %s backend $end\n", tr->inner->name);
+	fprintf(f, "$timescale 1ns $end\n");
+	fprintf(f, "$scope module icp $end\n");
+	fprintf(f, "$var wire 1 ! clk $end\n");
+	fprintf(f, "$var wire 1 \" rst $end\n");
+	fprintf(f, "$var wire 1 # dat_out $end\n");
+	for (int n = 0; n < tr->num_dats; n++)
+		fprintf(f, "$var wire 1 %c dat%d_gpio%d $end\n", '$' + n, n, gpios[n]);
+	fprintf(f, "$upscope $end\n$enddefinitions $end\n");
+
+	for (uint32_t i = 0; i < tr->num_events; i++) {
+		const struct trace_event *e = &tr->events[i];
+
+		fprintf(f, "#%llu\n", (unsigned long long)(e->t_ns - t0));
+		if (!i)
+			fprintf(f, "$dumpvars\n");
+		vcd_changes(f, prev, e->lines, !i);
+		if (!i)
+			fprintf(f, "$end\n");
+		prev = e->lines;
+	}
+
+	if (fclose(f)) {
+		log_err("Writing trace to %s failed\n", path);
+		return -1;
+	}
+
+	log_info("Trace of %u line changes written to %s\n", tr->num_events, path);
+	if (tr->dropped)
+		log_info("Trace buffer was full, the last %u changes are missing\n", tr->dropped);
+
+	return 0;
+}
+
+static void trace_deinit(void)
+{
+	struct trace *tr = ctx_cur->pgm.trace;
+
+	tr->inner->deinit();
+
+	vcd_write(tr->path);
+	free(tr->events);
+	free(tr);
+	ctx_cur->pgm.trace = NULL;
+}
+
+/*
+ * Wrap the initialized backend b into the tracer, the VCD goes to path
+ * when it is deinitialized. Returns NULL if the buffer cannot be had.
+ */
+const struct pgm_backend *pgm_trace_wrap(const struct pgm_backend *b, const char *path)
+{
+	struct trace *tr;
+
+	tr = calloc(1, sizeof(*tr));
+	if (tr)
+		tr->events = malloc(TRACE_MAX_EVENTS * sizeof(*tr->events));
+	if (!tr || !tr->events) {
+		log_err("No memory for the trace buffer\n");
+		free(tr);
+		return NULL;
+	}
+	/* fault it in now, not while the clock is running */
+	memset(tr->events, 0, TRACE_MAX_EVENTS * sizeof(*tr->events));
+
+	tr->inner = b;
+	tr->path = path;
+	tr->num_dats = pgm_num_targets();
+	tr->lines = ~0U;
+
+	tr->backend = *b;
+	tr->backend.deinit = trace_deinit;
+	tr->backend.set_dats = trace_set_dats;
+	tr->backend.get_dats = trace_get_dats;
+	tr->backend.set_rst = trace_set_rst;
+	tr->backend.set_clk = trace_set_clk;
+	tr->backend.set_lines = b->set_lines ? trace_set_lines : NULL;
+	tr->backend.dat_dir = trace_dat_dir;
+	ctx_cur->pgm.trace = tr;
+
+	/* DAT is unknown until the first direction switch */
+	trace_record(TRACE_Z_MASK & (((1U << tr->num_dats) - 1) << TRACE_Z_SHIFT));
+
+	return &tr->backend;
+}
@@ -0,0 +1,77 @@
+/*
+ * nuvoicp - real-time execution mode
+ *
+ * The protocol is clocked in software, so a preemption in the middle of
+ * a byte stretches a clock pulse and a long one can make a programming
+ * run fail. rt_enter() pins the process to one CPU, ideally one kept free
+ * of other work with isolcpus=, locks all current and future memory after
+ * prefaulting some stack and switches to SCHED_FIFO. After that neither
+ * the scheduler nor a page fault gets between two clock edges.
+ *
+ * Distributed under the same terms as nuvoicp.c, see there.
+ */
+
+#define _GNU_SOURCE
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <sched.h>
+#include <sys/mman.h>
+
+#include "rt.h"
+#include "log.h"
+
+/* more than the deepest call chain down to a backend ever uses */
+#define RT_PREFAULT_STACK	(256 * 1024)
+#define RT_PAGE_SIZE		4096
+
+static void rt_prefault_stack(void)
+{
+	volatile uint8_t buf[RT_PREFAULT_STACK];
+
+	for (size_t i = 0; i < sizeof(buf); i += RT_PAGE_SIZE)
+		buf[i] = 0;
+}
+
+/*
+ * Enter RT mode with the given SCHED_FIFO priority, on CPU cpu unless it
+ * is negative. Memory that is mapped later, like the GPIO registers or
+ * backend buffers, is locked and faulted in by mlockall() as it appears.
+ */
+int rt_enter(int prio, int cpu)
+{
+	struct sched_param sp = { .sched_priority = prio };
+	int err;
+
+	if (cpu >= 0) {
+		cpu_set_t set;
+
+		CPU_ZERO(&set);
+		CPU_SET(cpu, &set);
+		if (sched_setaffinity(0, sizeof(set), &set) < 0) {
+			err = errno;
+			log_err("Pinning to CPU %d failed: %s\n", cpu, strerror(err));
+			return -err;
+		}
+	}
+
+	if (mlockall(MCL_CURRENT | MCL_FUTURE) < 0) {
+		err = errno;
+		log_err("Locking memory failed: %s\n", strerror(err));
+		return -err;
+	}
+	rt_prefault_stack();
+
+	if (sched_setscheduler(0, SCHED_FIFO, &sp) < 0) {
+		err = errno;
+		log_err("Switching to SCHED_FIFO failed: %s\n", strerror(err));
+		return -err;
+	}
+
+	if (cpu >= 0)
+		log_info("RT mode: SCHED_FIFO priority %d on CPU %d\n", prio, cpu);
+	else
+		log_info("RT mode: SCHED_FIFO priority %d\n", prio);
+
+	return 0;
+}
@@ -0,0 +1,14 @@
+/*
+ * nuvoicp - real-time execution mode
+ *
+ * Distributed under the same terms as nuvoicp.c, see there.
+ */
+
+#ifndef RT_H
+#define RT_H
+
+#define RT_DEFAULT_PRIO		80
+
+int rt_enter(int prio, int cpu);
+
+#endif
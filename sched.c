@@ -0,0 +1,458 @@
+/*
+ * nuvoicp - multi-socket job scheduler
+ *
+ * Runs a file of jobs on several independent sockets, each with its own
+ * CLK, RST and DAT, and optionally its own backend. Every socket gets a
+ * worker thread and a context of its own, with the backend, the ICP
+ * state and the log, so a slow erase on one socket overlaps with writes
+ * on the others instead of holding up the fixture. Workers take the next
+ * job in file order that is theirs or for any socket.
+ *
+ * One job per line, like the daemon requests with the socket in front,
+ * a number in the order of -S or '*' for whichever is free first:
+ *
+ *   0 program fw_a.hex [ldrom=<file>] [diff] [pageverify]
+ *   1 program fw_b.hex
+ *   * verify fw.hex
+ *   * read dump.bin
+ *   2 erase
+ *   * identify
+ *
+ * Images are loaded once, before the workers start. Each job gets a line
+ * with a JSON object on stdout, the daemon's plus "socket" and "line",
+ * and the log of each socket goes to stderr with its number in front.
+ * The summary compares the time the fixture took with the time the jobs
+ * would have taken one after the other. Both are on the backend clocks,
+ * so simulated sockets (-S ...:sim) report what the wire would take.
+ *
+ * Distributed under the same terms as nuvoicp.c, see there.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+
+#include "sched.h"
+#include "job.h"
+#include "session.h"
+#include "icp.h"
+#include "image.h"
+#include "perf.h"
+#include "log.h"
+#include "pgm.h"
+#include "rt.h"
+#include "ctx.h"
+
+#define SCHED_MAX_IMAGES	16
+#define SCHED_MAX_LINE		1024
+
+struct sched_job {
+	struct job job;
+	int line;
+	int socket;			/* -1 for any */
+	char *path;			/* copy of job.path */
+	int taken;
+	int done;
+};
+
+struct sched_socket {
+	int clk, rst, dat;
+	char *backend;			/* NULL for the one of -b */
+	pthread_t thread;
+	struct ctx *ctx;		/* the worker's target state */
+	int up;				/* the backend opened */
+	int jobs, failed;
+	uint64_t busy_ns;		/* on the backend clock */
+	uint64_t elapsed_ns;
+
+	/* log lines of the worker are put together before they go out */
+	char log_line[SCHED_MAX_LINE];
+	size_t log_len;
+};
+
+struct sched_image {
+	char *path;
+	uint32_t raw_addr;
+	struct image img;
+};
+
+static struct sched_socket sockets[SCHED_MAX_SOCKETS];
+static int num_sockets;
+static const char *default_backend;
+static int worker_rt_prio, worker_rt_cpu;
+
+static struct sched_image images[SCHED_MAX_IMAGES];
+static int num_images;
+
+/* the queue, and the result lines and counters */
+static struct sched_job *jobs;
+static int num_jobs;
+static pthread_mutex_t queue_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t out_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* "<clk>,<rst>,<dat>[:<backend>]", for -S */
+int sched_add_socket(const char *spec)
+{
+	struct sched_socket *so = &sockets[num_sockets];
+	const char *backend = strchr(spec, ':');
+
+	if (num_sockets == SCHED_MAX_SOCKETS) {
+		log_err("At most %d sockets are supported\n", SCHED_MAX_SOCKETS);
+		return -EINVAL;
+	}
+	if (sscanf(spec, "%d,%d,%d", &so->clk, &so->rst, &so->dat) != 3 ||
+	    so->clk < 0 || so->rst < 0 || so->dat < 0 ||
+	    so->clk == so->rst || so->clk == so->dat || so->rst == so->dat) {
+		log_err("Bad socket '%s', need three different GPIOs <clk>,<rst>,<dat>\n", spec);
+		return -EINVAL;
+	}
+
+	/* sockets are independent, sharing a line would mix two targets */
+	for (int i = 0; i < num_sockets; i++) {
+		const int a[] = { so->clk, so->rst, so->dat };
+		const int b[] = { sockets[i].clk, sockets[i].rst, sockets[i].dat };
+
+		for (int j = 0; j < 3; j++) {
+			for (int k = 0; k < 3; k++) {
+				if (a[j] == b[k]) {
+					log_err("Socket '%s' shares GPIO%d with socket %d\n",
+						spec, a[j], i);
+					return -EINVAL;
+				}
+			}
+		}
+	}
+
+	so->backend = backend ? strdup(backend + 1) : NULL;
+	num_sockets++;
+
+	return 0;
+}
+
+/* images are shared by the jobs that name them, loaded once */
+static const struct image *sched_image(const char *path, uint32_t raw_addr)
+{
+	struct sched_image *si;
+
+	for (int i = 0; i < num_images; i++) {
+		if (!strcmp(images[i].path, path) && images[i].raw_addr == raw_addr)
+			return &images[i].img;
+	}
+
+	if (num_images == SCHED_MAX_IMAGES) {
+		log_err("More than %d images\n", SCHED_MAX_IMAGES);
+		return NULL;
+	}
+
+	si = &images[num_images];
+	if (image_load(&si->img, path, raw_addr) < 0)
+		return NULL;
+	si->path = strdup(path);
+	si->raw_addr = raw_addr;
+	num_images++;
+
+	return &si->img;
+}
+
+static int parse_error(const char *path, int line, const char *msg)
+{
+	log_err("%s:%d: %s\n", path, line, msg);
+	return -EINVAL;
+}
+
+static int sched_parse_job(struct sched_job *job, const char *path, char **args, int nargs)
+{
+	const char *err;
+
+	if (!strcmp(args[0], "*")) {
+		job->socket = -1;
+	} else {
+		char *end;
+
+		job->socket = strtol(args[0], &end, 10);
+		if (*end || job->socket < 0 || job->socket >= num_sockets)
+			return parse_error(path, job->line, "no such socket");
+	}
+
+	err = job_parse(&job->job, args + 1, nargs - 1, sched_image);
+	if (err)
+		return parse_error(path, job->line, err);
+	if (!job_uses_target(&job->job))
+		return parse_error(path, job->line, "not a job for a socket");
+
+	/* the arguments are gone once the next line is read */
+	if (job->job.path)
+		job->job.path = job->path = strdup(job->job.path);
+
+	return 0;
+}
+
+static int sched_load(const char *path)
+{
+	char line[SCHED_MAX_LINE];
+	int lineno = 0, max = 0, ret = 0;
+	FILE *f;
+
+	f = fopen(path, "r");
+	if (!f) {
+		log_err("Opening %s failed: %s\n", path, strerror(errno));
+		return -ENOENT;
+	}
+
+	while (ret >= 0 && fgets(line, sizeof(line), f)) {
+		char *args[JOB_MAX_ARGS + 1], *save = NULL;
+		int nargs = 0;
+
+		lineno++;
+		if (line[0] == '#')
+			continue;
+		for (char *tok = strtok_r(line, " \t\r\n", &save); tok && nargs < JOB_MAX_ARGS + 1;
+		     tok = strtok_r(NULL, " \t\r\n", &save))
+			args[nargs++] = tok;
+		if (!nargs)
+			continue;
+
+		if (num_jobs == max) {
+			struct sched_job *j;
+
+			max = max ? 2 * max : 64;
+			j = realloc(jobs, max * sizeof(*j));
+			if (!j) {
+				ret = -ENOMEM;
+				break;
+			}
+			jobs = j;
+		}
+
+		memset(&jobs[num_jobs], 0, sizeof(jobs[num_jobs]));
+		jobs[num_jobs].line = lineno;
+		ret = sched_parse_job(&jobs[num_jobs], path, args, nargs);
+		num_jobs++;
+	}
+	fclose(f);
+
+	if (ret >= 0 && !num_jobs) {
+		log_err("No jobs in %s\n", path);
+		ret = -EINVAL;
+	}
+
+	return ret;
+}
+
+/* the next job for socket n in file order, NULL when there is none */
+static struct sched_job *sched_take(int n)
+{
+	struct sched_job *job = NULL;
+
+	pthread_mutex_lock(&queue_lock);
+	for (int i = 0; i < num_jobs; i++) {
+		if (!jobs[i].taken && (jobs[i].socket < 0 || jobs[i].socket == n)) {
+			job = &jobs[i];
+			job->taken = 1;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&queue_lock);
+
+	return job;
+}
+
+static void sched_log(int level, const char *msg, void *user)
+{
+	struct sched_socket *so = user;
+
+	for (const char *p = msg; *p; p++) {
+		if (so->log_len < sizeof(so->log_line) - 2)
+			so->log_line[so->log_len++] = *p;
+		if (*p == '\n') {
+			so->log_line[so->log_len] = '\0';
+			fprintf(stderr, "[socket %d] %s", (int)(so - sockets), so->log_line);
+			so->log_len = 0;
+		}
+	}
+}
+
+static void sched_result(struct reply *r, uint64_t ns)
+{
+	reply_end(r, ns);
+
+	pthread_mutex_lock(&out_lock);
+	fputs(r->buf, stdout);
+	fflush(stdout);
+	pthread_mutex_unlock(&out_lock);
+}
+
+static void *sched_worker(void *arg)
+{
+	struct sched_socket *so = arg;
+	int n = so - sockets;
+	const char *backend = so->backend ? so->backend : default_backend;
+	struct icp_session s;
+	struct sched_job *job;
+	struct reply r;
+	uint64_t t_start;
+
+	ctx_use(so->ctx);
+	log_set_handler(sched_log, so);
+	perf_reset();
+
+	/* one CPU each, SCHED_FIFO workers sharing one would starve each other */
+	if ((worker_rt_prio &&
+	     rt_enter(worker_rt_prio, worker_rt_cpu < 0 ? -1 : worker_rt_cpu + n) < 0) ||
+	    pgm_select(backend) < 0 || pgm_set_dat_gpios(&so->dat, 1) < 0 ||
+	    pgm_set_ctl_gpios(so->clk, so->rst) < 0 || pgm_init() < 0) {
+		log_err("Socket %d not available\n", n);
+		goto out;
+	}
+	so->up = 1;
+
+	session_init(&s);
+	t_start = pgm_now_ns();
+
+	while ((job = sched_take(n))) {
+		uint64_t t_job = pgm_now_ns();
+		int ret;
+
+		snprintf(r.tag, sizeof(r.tag), ",\"line\":%d,\"socket\":%d", job->line, n);
+		reply_start(&r, &job->job);
+		ret = job_run(&s, &job->job, &r);
+
+		/* let the unit run, it may be swapped before the next job */
+		session_exit(&s);
+
+		so->busy_ns += pgm_now_ns() - t_job;
+		so->jobs++;
+		if (ret < 0)
+			so->failed++;
+		job->done = 1;
+		sched_result(&r, pgm_now_ns() - t_job);
+	}
+
+	so->elapsed_ns = pgm_now_ns() - t_start;
+	pgm_deinit();
+
+out:
+	log_exit();
+	log_set_handler(NULL, NULL);
+	ctx_use(NULL);
+	return NULL;
+}
+
+static void sched_report(void)
+{
+	uint64_t busy = 0, elapsed = 0;
+	int failed = 0;
+
+	for (int i = 0; i < num_jobs; i++) {
+		struct reply r;
+
+		if (jobs[i].done)
+			continue;
+		/* its socket never came up, nor did any other for '*' */
+		snprintf(r.tag, sizeof(r.tag), ",\"line\":%d,\"socket\":%d", jobs[i].line,
+			 jobs[i].socket);
+		reply_error(&r, &jobs[i].job, "socket not available");
+		sched_result(&r, 0);
+		failed++;
+	}
+
+	for (int n = 0; n < num_sockets; n++) {
+		const struct sched_socket *so = &sockets[n];
+
+		log_info("Socket %d (CLK %d, RST %d, DAT %d): ", n, so->clk, so->rst, so->dat);
+		if (so->up)
+			log_info("%d jobs, %d failed, busy %.2f s of %.2f s\n", so->jobs,
+				 so->failed, so->busy_ns / 1e9, so->elapsed_ns / 1e9);
+		else
+			log_info("not available\n");
+
+		failed += so->failed;
+		busy += so->busy_ns;
+		if (so->elapsed_ns > elapsed)
+			elapsed = so->elapsed_ns;
+	}
+
+	log_info("Fixture: %d jobs, %d OK, %d failed, %.2f s on %d sockets",
+		 num_jobs, num_jobs - failed, failed, elapsed / 1e9, num_sockets);
+	if (elapsed)
+		log_info(", %.2f s one after the other (%.2fx)\n", busy / 1e9,
+			 (double)busy / elapsed);
+	else
+		log_info("\n");
+}
+
+/*
+ * Run the jobs of job_file on the -S sockets, or on one at the pins of
+ * the current context if there are none. backend is the -b selection, NULL for the
+ * default, for the sockets without their own. With rt_prio each worker
+ * enters RT mode, worker n on CPU rt_cpu + n if rt_cpu is not negative.
+ * Returns <0 if any job failed.
+ */
+int sched_run(const char *job_file, const char *backend, int rt_prio, int rt_cpu)
+{
+	int failed = 0, ret;
+
+	if (!num_sockets) {
+		char spec[32];
+
+		snprintf(spec, sizeof(spec), "%d,%d,%d", pgm_clk_gpio(), pgm_rst_gpio(),
+			 pgm_dat_gpios()[0]);
+		if (sched_add_socket(spec) < 0)
+			return -EINVAL;
+	}
+
+	ret = sched_load(job_file);
+	if (ret < 0)
+		goto out;
+
+	default_backend = backend;
+	worker_rt_prio = rt_prio;
+	worker_rt_cpu = rt_cpu;
+
+	log_info("Scheduler: %d jobs on %d sockets\n", num_jobs, num_sockets);
+
+	for (int n = 0; n < num_sockets; n++) {
+		sockets[n].ctx = ctx_new();
+		if (!sockets[n].ctx) {
+			log_err("No memory for socket %d\n", n);
+			ret = -ENOMEM;
+			num_sockets = n;
+			break;
+		}
+		if (pthread_create(&sockets[n].thread, NULL, sched_worker, &sockets[n])) {
+			log_err("Starting the worker of socket %d failed\n", n);
+			ctx_free(sockets[n].ctx);
+			sockets[n].ctx = NULL;
+			ret = -EAGAIN;
+			num_sockets = n;
+			break;
+		}
+	}
+	for (int n = 0; n < num_sockets; n++) {
+		pthread_join(sockets[n].thread, NULL);
+		ctx_free(sockets[n].ctx);
+	}
+
+	sched_report();
+
+	for (int i = 0; i < num_jobs; i++)
+		failed |= !jobs[i].done;
+	for (int n = 0; n < num_sockets; n++)
+		failed |= sockets[n].failed;
+
+out:
+	for (int i = 0; i < num_jobs; i++)
+		free(jobs[i].path);
+	free(jobs);
+	for (int i = 0; i < num_images; i++) {
+		free(images[i].path);
+		image_free(&images[i].img);
+	}
+	for (int n = 0; n < SCHED_MAX_SOCKETS; n++)
+		free(sockets[n].backend);
+
+	return ret < 0 || failed ? -1 : 0;
+}
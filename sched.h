@@ -0,0 +1,15 @@
+/*
+ * nuvoicp - multi-socket job scheduler
+ *
+ * Distributed under the same terms as nuvoicp.c, see there.
+ */
+
+#ifndef SCHED_H
+#define SCHED_H
+
+#define SCHED_MAX_SOCKETS	8
+
+int sched_add_socket(const char *spec);
+int sched_run(const char *job_file, const char *backend, int rt_prio, int rt_cpu);
+
+#endif
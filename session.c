@@ -0,0 +1,226 @@
+/*
+ * nuvoicp - ICP session
+ *
+ * Tracks what is known about the target while it is in ICP mode: its
+ * IDs and UID, CONFIG and whether the flash is erased, so each of them is
+ * read or done once per session. session_program() turns a plan of the
+ * requested operations into one pass: at most one mass erase, CONFIG
+ * worked out up front and written once, then LDROM and APROM.
+ *
+ * Distributed under the same terms as nuvoicp.c, see there.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "session.h"
+#include "icp.h"
+#include "image.h"
+#include "journal.h"
+#include "log.h"
+#include "ctx.h"
+
+/* full entry sequence, for a target that may be running its firmware */
+void session_init(struct icp_session *s)
+{
+	memset(s, 0, sizeof(*s));
+	icp_init();
+	s->in_icp = 1;
+}
+
+/*
+ * Short reset back into ICP mode. The unit may have been swapped, so
+ * everything known about it is dropped. A freshly plugged one needs the
+ * full entry sequence. Returns <0 if no target answers.
+ */
+int session_reenter(struct icp_session *s)
+{
+	memset(s, 0, sizeof(*s));
+	icp_reinit();
+	s->in_icp = 1;
+
+	s->cid = icp_read_cid();
+	if (s->cid != NUVOTON_ID) {
+		icp_init();
+		s->cid = icp_read_cid();
+	}
+
+	return s->cid == NUVOTON_ID ? 0 : -1;
+}
+
+void session_exit(struct icp_session *s)
+{
+	if (s->in_icp)
+		icp_exit();
+	s->in_icp = 0;
+	s->identified = 0;
+	s->have_cfg = 0;
+}
+
+/*
+ * Read CID, device ID and UID once and make the device the current one.
+ * Returns <0 if the device ID is not in the table, s->devid has it.
+ */
+int session_identify(struct icp_session *s)
+{
+	if (s->identified)
+		return 0;
+
+	if (s->cid != NUVOTON_ID)
+		s->cid = icp_read_cid();
+	s->devid = icp_read_device_id();
+	s->dev = icp_find_device(s->devid);
+	if (!s->dev)
+		return -1;
+
+	icp_dev = s->dev;
+	icp_read_uid_bytes(s->uid);
+	s->identified = 1;
+
+	return 0;
+}
+
+/*
+ * session_identify() and log what was found, the first time or what is
+ * wrong, each time.
+ */
+int session_announce(struct icp_session *s)
+{
+	if (s->identified)
+		return 0;
+
+	int unknown = session_identify(s) < 0;
+
+	log_info("CID\t\t\t0x%01x\n", s->cid);
+	if (unknown) {
+		log_err("Unknown Device ID: 0x%02x\n", s->devid);
+		return -1;
+	}
+	log_info("Found %s, {0x%02x}\n", s->dev->name, s->devid);
+	log_info("UID\t\t\t");
+	for (int i = 0; i < ICP_UID_LEN; i++)
+		log_info("%02x", s->uid[i]);
+	log_info("\n");
+
+	icp_print_config(session_config(s));
+
+	return 0;
+}
+
+/* CONFIG as it is in the chip, read on first use */
+const uint8_t *session_config(struct icp_session *s)
+{
+	if (!s->have_cfg) {
+		icp_read_config(s->cfg);
+		s->have_cfg = 1;
+	}
+
+	return s->cfg;
+}
+
+static void session_mass_erase(struct icp_session *s)
+{
+	if (s->erased)
+		return;
+
+	icp_mass_erase();
+	s->erased = 1;
+	memset(s->cfg, 0xff, sizeof(s->cfg));
+	s->have_cfg = 1;
+}
+
+/*
+ * Bring CONFIG to cfg, unless it already is. Programming only clears
+ * bits, the page is erased first if any have to be set. Read back
+ * right away, returns <0 if it did not take.
+ */
+static int session_write_config(struct icp_session *s, const uint8_t *cfg)
+{
+	const uint8_t *cur = session_config(s);
+	uint8_t data[CFG_FLASH_LEN];
+
+	if (!memcmp(cur, cfg, CFG_FLASH_LEN))
+		return 0;
+
+	for (int i = 0; i < CFG_FLASH_LEN; i++) {
+		if ((cur[i] & cfg[i]) != cfg[i]) {
+			icp_cfg_erase();
+			break;
+		}
+	}
+
+	memcpy(data, cfg, sizeof(data));
+	icp_cfg_byte_write(data);
+
+	s->have_cfg = 0;
+	if (icp_range_verify(CMD_APROM_BYTE_READ, CFG_FLASH_ADDR, CFG_FLASH_LEN, cfg) < 0) {
+		log_err("CONFIG did not verify\n");
+		return -1;
+	}
+
+	memcpy(s->cfg, cfg, sizeof(s->cfg));
+	s->have_cfg = 1;
+	log_info("Programmed CONFIG\n");
+	icp_print_config(s->cfg);
+
+	return 0;
+}
+
+/*
+ * Run the plan: one mass erase for a chip erase or any programming, none
+ * in diff mode or when a journaled run resumes. CONFIG ends up as the one
+ * the APROM image carries, or as it was, with the size of and boot from
+ * the LDROM if one is programmed. LDROM and APROM each get a single
+ * pass, CONFIG is written last and only if both verified, so a run cut
+ * short or failing never leaves a locked chip or one booting from a half
+ * written LDROM. Returns <0 if any part failed, the plan says which.
+ */
+int session_program(struct icp_session *s, struct icp_plan *p)
+{
+	struct icp_layout layout;
+	uint8_t cfg[CFG_FLASH_LEN];
+	int size;
+
+	p->ldrom_ret = p->aprom_ret = p->cfg_ret = 0;
+	p->ldrom_size = p->aprom_size = 0;
+
+	if (p->ldrom) {
+		size = icp_ldrom_size(p->ldrom);
+		if (size < 0)
+			return p->ldrom_ret = -1;
+		p->ldrom_size = size;
+	}
+
+	if (p->erase || ((p->aprom || p->ldrom) && !p->diff_mode && !journal_resuming()))
+		session_mass_erase(s);
+
+	if (!p->aprom && !p->ldrom)
+		return 0;
+
+	memcpy(cfg, session_config(s), sizeof(cfg));
+	icp_image_config(p->aprom, p->ldrom_size, cfg);
+
+	icp_decode_config(cfg, &layout);
+	p->ldrom_size = layout.ldrom_size;
+
+	if (p->ldrom)
+		p->ldrom_ret = icp_program_ldrom(p->ldrom, p->ldrom_size, p->diff_mode,
+						 p->page_verify);
+
+	if (p->aprom) {
+		p->aprom_size = icp_aprom_size(p->aprom, p->ldrom_size);
+		p->aprom_ret = icp_program_aprom(p->aprom, p->aprom_size, p->diff_mode,
+						 p->page_verify);
+	}
+
+	s->erased = 0;
+
+	if (p->ldrom_ret < 0 || p->aprom_ret < 0)
+		log_err("Flash failed, CONFIG left as it was\n");
+	else
+		p->cfg_ret = session_write_config(s, cfg);
+
+	return p->cfg_ret < 0 || p->ldrom_ret < 0 || p->aprom_ret < 0 ? -1 : 0;
+}
@@ -0,0 +1,50 @@
+/*
+ * nuvoicp - ICP session
+ *
+ * Distributed under the same terms as nuvoicp.c, see there.
+ */
+
+#ifndef SESSION_H
+#define SESSION_H
+
+#include <stdint.h>
+
+#include "icp.h"
+
+struct image;
+
+/* what is known about the target since it entered ICP mode */
+struct icp_session {
+	int in_icp;
+	int identified;			/* cid, devid, dev and uid are valid */
+	uint8_t cid;
+	uint16_t devid;
+	const struct icp_device *dev;
+	uint8_t uid[ICP_UID_LEN];
+	int have_cfg;
+	uint8_t cfg[CFG_FLASH_LEN];
+	int erased;			/* flash and CONFIG blank */
+};
+
+/* the operations asked for, session_program() orders them */
+struct icp_plan {
+	int erase;			/* whole chip, with or without images */
+	const struct image *aprom;	/* NULL to leave APROM alone */
+	const struct image *ldrom;	/* NULL to leave LDROM alone */
+	int diff_mode;
+	int page_verify;
+
+	/* filled in by session_program(), <0 for the parts that failed */
+	int ldrom_ret, aprom_ret, cfg_ret;
+	uint32_t ldrom_size, aprom_size;
+};
+
+void session_init(struct icp_session *s);
+int session_reenter(struct icp_session *s);
+void session_exit(struct icp_session *s);
+int session_identify(struct icp_session *s);
+int session_announce(struct icp_session *s);
+const uint8_t *session_config(struct icp_session *s);
+int session_program(struct icp_session *s, struct icp_plan *p);
+
+#endif
@@ -0,0 +1,211 @@
+/*
+ * nuvoicp - precise protocol delays
+ *
+ * usleep() leaves the wakeup to the scheduler, which regularly turns a
+ * 50 us wait into 100 us or more. Waits longer than the measured wakeup
+ * latency sleep with clock_nanosleep(TIMER_ABSTIME) until just before the
+ * deadline and busy-wait the rest on CLOCK_MONOTONIC, shorter waits only
+ * busy-wait. Every delay is measured so the overshoot can be reported.
+ *
+ * Optionally the ICP code marks every rising clock edge and every byte,
+ * the distance between two marks goes into a log2 histogram per kind, so
+ * the clock period envelope of a run can be checked.
+ *
+ * Distributed under the same terms as nuvoicp.c, see there.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+
+#include "timing.h"
+#include "log.h"
+#include "ctx.h"
+
+#define CALIB_ROUNDS		8
+#define CALIB_SLEEP_NS		200000
+
+static const char *hist_names[TIMING_HIST_NUM] = {
+	[TIMING_HIST_BIT]	= "bit period",
+	[TIMING_HIST_BYTE]	= "byte period",
+};
+
+uint64_t timing_now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void sleep_until(uint64_t deadline)
+{
+	struct timespec ts = {
+		.tv_sec = deadline / 1000000000ULL,
+		.tv_nsec = deadline % 1000000000ULL,
+	};
+
+	/* it returns the error, only an interrupted sleep is worth retrying */
+	while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR)
+		;
+}
+
+void timing_ctx_init(struct timing_state *ts)
+{
+	ts->slack_ns = TIMING_MIN_SLACK_NS;
+}
+
+/* find out how late clock_nanosleep() wakes us up on this system */
+void timing_init(void)
+{
+	struct timing_state *ts = &ctx_cur->timing;
+	uint64_t worst = 0;
+
+	for (int i = 0; i < CALIB_ROUNDS; i++) {
+		uint64_t deadline = timing_now_ns() + CALIB_SLEEP_NS;
+		uint64_t late;
+
+		sleep_until(deadline);
+		late = timing_now_ns() - deadline;
+		if (late > worst)
+			worst = late;
+	}
+
+	ts->slack_ns = worst * 2 > TIMING_MIN_SLACK_NS ? worst * 2 : TIMING_MIN_SLACK_NS;
+	memset(&ts->stats, 0, sizeof(ts->stats));
+}
+
+void timing_delay_us(unsigned int usec)
+{
+	struct timing_state *ts = &ctx_cur->timing;
+	uint64_t start = timing_now_ns();
+	uint64_t deadline = start + usec * 1000ULL;
+	uint64_t now;
+
+	if (usec * 1000ULL > ts->slack_ns)
+		sleep_until(deadline - ts->slack_ns);
+
+	do
+		now = timing_now_ns();
+	while (now < deadline);
+
+	ts->stats.delays++;
+	ts->stats.requested_ns += usec * 1000ULL;
+	ts->stats.actual_ns += now - start;
+	if (now - deadline > ts->stats.worst_over_ns)
+		ts->stats.worst_over_ns = now - deadline;
+}
+
+void timing_get_stats(struct timing_stats *st)
+{
+	*st = ctx_cur->timing.stats;
+}
+
+void timing_print_stats(void)
+{
+	const struct timing_state *ts = &ctx_cur->timing;
+	const struct timing_stats *stats = &ts->stats;
+
+	if (!stats->delays)
+		return;
+
+	log_info("timing: %llu delays, %.3f ms requested, %.3f ms actual "
+		"(+%.2f%%), worst overshoot %.1f us, wakeup slack %.1f us\n",
+		(unsigned long long)stats->delays, stats->requested_ns / 1e6,
+		stats->actual_ns / 1e6,
+		stats->requested_ns ? 100.0 * (stats->actual_ns - stats->requested_ns) /
+				      stats->requested_ns : 0.0,
+		stats->worst_over_ns / 1e3, ts->slack_ns / 1e3);
+}
+
+void timing_hist_enable(void)
+{
+	struct timing_state *ts = &ctx_cur->timing;
+
+	ts->hist_on = 1;
+	memset(ts->hists, 0, sizeof(ts->hists));
+	memset(ts->hist_last, 0, sizeof(ts->hist_last));
+}
+
+/* record the time since the previous mark of the same kind */
+void timing_mark(enum timing_hist_id id)
+{
+	struct timing_state *ts = &ctx_cur->timing;
+	struct timing_hist *h = &ts->hists[id];
+	uint64_t now, d;
+	int b;
+
+	if (!ts->hist_on)
+		return;
+
+	now = timing_now_ns();
+	d = now - ts->hist_last[id];
+	if (!ts->hist_last[id]) {
+		ts->hist_last[id] = now;
+		return;
+	}
+	ts->hist_last[id] = now;
+
+	b = d ? 63 - __builtin_clzll(d) : 0;
+	if (b >= TIMING_HIST_BUCKETS)
+		b = TIMING_HIST_BUCKETS - 1;
+
+	h->buckets[b]++;
+	h->sum_ns += d;
+	if (!h->count || d < h->min_ns)
+		h->min_ns = d;
+	if (d > h->max_ns)
+		h->max_ns = d;
+	h->count++;
+}
+
+/* the next mark starts a new chain, e.g. at the start of a command */
+void timing_mark_break(enum timing_hist_id id)
+{
+	ctx_cur->timing.hist_last[id] = 0;
+}
+
+void timing_get_hist(enum timing_hist_id id, struct timing_hist *h)
+{
+	*h = ctx_cur->timing.hists[id];
+}
+
+/* upper bound of the bucket holding the given fraction of the samples */
+static uint64_t hist_percentile(const struct timing_hist *h, double frac)
+{
+	uint64_t want = h->count * frac, seen = 0;
+
+	for (int b = 0; b < TIMING_HIST_BUCKETS; b++) {
+		seen += h->buckets[b];
+		if (seen > want)
+			return 2ULL << b;
+	}
+
+	return h->max_ns;
+}
+
+void timing_print_hists(void)
+{
+	const struct timing_state *ts = &ctx_cur->timing;
+
+	for (int id = 0; ts->hist_on && id < TIMING_HIST_NUM; id++) {
+		const struct timing_hist *h = &ts->hists[id];
+
+		if (!h->count)
+			continue;
+
+		log_info("timing: %s, %llu samples, min %.2f us, avg %.2f us, "
+			"max %.2f us, p99 < %.2f us, p99.9 < %.2f us\n",
+			hist_names[id], (unsigned long long)h->count, h->min_ns / 1e3,
+			h->sum_ns / 1e3 / h->count, h->max_ns / 1e3,
+			hist_percentile(h, 0.99) / 1e3, hist_percentile(h, 0.999) / 1e3);
+
+		for (int b = 0; b < TIMING_HIST_BUCKETS; b++) {
+			if (h->buckets[b])
+				log_info("  %10.3f - %10.3f us: %llu\n", (1ULL << b) / 1e3,
+					(2ULL << b) / 1e3, (unsigned long long)h->buckets[b]);
+		}
+	}
+}
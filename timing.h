@@ -0,0 +1,61 @@
+/*
+ * nuvoicp - precise protocol delays
+ *
+ * Distributed under the same terms as nuvoicp.c, see there.
+ */
+
+#ifndef TIMING_H
+#define TIMING_H
+
+#include <stdint.h>
+
+struct timing_stats {
+	uint64_t delays;
+	uint64_t requested_ns;
+	uint64_t actual_ns;
+	uint64_t worst_over_ns;
+};
+
+void timing_init(void);
+uint64_t timing_now_ns(void);
+void timing_delay_us(unsigned int usec);
+void timing_get_stats(struct timing_stats *st);
+void timing_print_stats(void);
+
+/* clock period histograms, see timing_mark() */
+enum timing_hist_id {
+	TIMING_HIST_BIT,
+	TIMING_HIST_BYTE,
+	TIMING_HIST_NUM,
+};
+
+#define TIMING_HIST_BUCKETS	40	/* powers of two, 1 ns to ~9 min */
+
+struct timing_hist {
+	uint64_t count;
+	uint64_t sum_ns;
+	uint64_t min_ns;
+	uint64_t max_ns;
+	uint64_t buckets[TIMING_HIST_BUCKETS];
+};
+
+/* never trust the scheduler more than this */
+#define TIMING_MIN_SLACK_NS	20000
+
+/* per context, see ctx.h */
+struct timing_state {
+	uint64_t slack_ns;		/* how late clock_nanosleep() wakes up */
+	struct timing_stats stats;
+	int hist_on;
+	uint64_t hist_last[TIMING_HIST_NUM];
+	struct timing_hist hists[TIMING_HIST_NUM];
+};
+
+void timing_ctx_init(struct timing_state *ts);
+void timing_hist_enable(void);
+void timing_mark(enum timing_hist_id id);
+void timing_mark_break(enum timing_hist_id id);
+void timing_get_hist(enum timing_hist_id id, struct timing_hist *h);
+void timing_print_hists(void);
+
+#endif
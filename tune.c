@@ -0,0 +1,328 @@
+/*
+ * nuvoicp - timing profiles and their calibration
+ *
+ * The icp_write_byte() delays in the device table are worst case values.
+ * A profile replaces them for one device ID. Profiles are lines of a text
+ * file,
+ *
+ *   <name> <devid> <prog1> <prog2> <page1> <page2> <mass1> <mass2>
+ *
+ * named after the device, or after a board when boards with the same
+ * chip need timings of their own.
+ *
+ * Calibration finds them on the chip at hand. For the byte program, the
+ * page erase and the mass erase in turn, delay1 is bisected between 1 us
+ * and the default, with delay2 scaled along, down to the shortest one
+ * that passes TUNE_REPEATS program/erase cycles with read back in a row.
+ * The others stay at their defaults meanwhile. The cycles run on the last
+ * flash page, the mass erase ones on the first page as well, and wipe the
+ * chip. TUNE_MARGIN_PCT goes on top, never beyond the default, and the
+ * result has to pass the repeats once more before it is stored.
+ *
+ * Distributed under the same terms as nuvoicp.c, see there.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+
+#include "tune.h"
+#include "session.h"
+#include "icp.h"
+#include "log.h"
+#include "ctx.h"
+
+#define TUNE_LINE_MAX		128
+#define TUNE_NAME_MAX		32
+#define TUNE_LEN		ICP_MIN_PAGE_SIZE
+#define TUNE_REPEATS		4
+#define TUNE_MARGIN_PCT		50
+#define TUNE_RESOLUTION		32	/* bisect down to 1/32 of the delay */
+
+enum {
+	TUNE_PROG,
+	TUNE_PAGE_ERASE,
+	TUNE_MASS_ERASE,
+	TUNE_KINDS
+};
+
+static const char *const tune_kinds[TUNE_KINDS] = {
+	[TUNE_PROG]		= "byte program",
+	[TUNE_PAGE_ERASE]	= "page erase",
+	[TUNE_MASS_ERASE]	= "mass erase",
+};
+
+struct tune_profile {
+	char name[TUNE_NAME_MAX];
+	unsigned int devid;
+	int delay[TUNE_KINDS][2];	/* delay1, delay2 in us */
+};
+
+static void tune_get(const struct icp_device *dev, struct tune_profile *p)
+{
+	p->delay[TUNE_PROG][0] = dev->prog_delay1_us;
+	p->delay[TUNE_PROG][1] = dev->prog_delay2_us;
+	p->delay[TUNE_PAGE_ERASE][0] = dev->page_erase_delay1_us;
+	p->delay[TUNE_PAGE_ERASE][1] = dev->page_erase_delay2_us;
+	p->delay[TUNE_MASS_ERASE][0] = dev->mass_erase_delay1_us;
+	p->delay[TUNE_MASS_ERASE][1] = dev->mass_erase_delay2_us;
+}
+
+static void tune_set(struct icp_device *dev, const struct tune_profile *p)
+{
+	dev->prog_delay1_us = p->delay[TUNE_PROG][0];
+	dev->prog_delay2_us = p->delay[TUNE_PROG][1];
+	dev->page_erase_delay1_us = p->delay[TUNE_PAGE_ERASE][0];
+	dev->page_erase_delay2_us = p->delay[TUNE_PAGE_ERASE][1];
+	dev->mass_erase_delay1_us = p->delay[TUNE_MASS_ERASE][0];
+	dev->mass_erase_delay2_us = p->delay[TUNE_MASS_ERASE][1];
+}
+
+static void tune_print(const char *what, const struct tune_profile *p, const char *dev_name)
+{
+	log_info("%s %s for %s: byte %d/%d us, page erase %d/%d us, mass erase %d/%d us\n",
+		 what, p->name, dev_name, p->delay[TUNE_PROG][0], p->delay[TUNE_PROG][1],
+		 p->delay[TUNE_PAGE_ERASE][0], p->delay[TUNE_PAGE_ERASE][1],
+		 p->delay[TUNE_MASS_ERASE][0], p->delay[TUNE_MASS_ERASE][1]);
+}
+
+/* 0 for a profile line, -1 for comments and anything malformed */
+static int tune_parse(const char *line, struct tune_profile *p)
+{
+	int *d = &p->delay[0][0];
+
+	if (line[0] == '#')
+		return -1;
+	if (sscanf(line, "%31s %x %d %d %d %d %d %d", p->name, &p->devid,
+		   &d[0], &d[1], &d[2], &d[3], &d[4], &d[5]) != 8)
+		return -1;
+
+	for (int i = 0; i < 2 * TUNE_KINDS; i++) {
+		if (d[i] <= 0)
+			return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * Apply the profiles of path to the device table: the one called name,
+ * or with name NULL each one named after its device. Returns how many
+ * were applied, <0 if the file cannot be read or name is not in it.
+ */
+int tune_load(const char *path, const char *name)
+{
+	char line[TUNE_LINE_MAX];
+	int loaded = 0;
+	FILE *f;
+
+	f = fopen(path, "r");
+	if (!f) {
+		log_err("Opening %s failed: %s\n", path, strerror(errno));
+		return -1;
+	}
+
+	while (fgets(line, sizeof(line), f)) {
+		struct tune_profile p;
+		struct icp_device *dev;
+
+		if (tune_parse(line, &p) < 0)
+			continue;
+		dev = icp_tune_device(p.devid);
+		if (!dev || strcmp(p.name, name ? name : dev->name))
+			continue;
+
+		tune_set(dev, &p);
+		tune_print("Timing profile", &p, dev->name);
+		loaded++;
+	}
+	fclose(f);
+
+	if (name && !loaded) {
+		log_err("No timing profile %s for a known device in %s\n", name, path);
+		return -1;
+	}
+
+	return loaded;
+}
+
+/* list the profile, replacing one of the same name */
+static int tune_store(const char *path, const struct tune_profile *p)
+{
+	char line[TUNE_LINE_MAX], tmp[4096];
+	size_t len = strlen(p->name);
+	FILE *in, *out;
+
+	snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+
+	out = fopen(tmp, "w");
+	if (!out) {
+		log_err("Writing %s failed: %s\n", tmp, strerror(errno));
+		return -1;
+	}
+
+	fprintf(out, "# name devid prog1 prog2 page1 page2 mass1 mass2 (us)\n");
+	in = fopen(path, "r");
+	while (in && fgets(line, sizeof(line), in)) {
+		if (line[0] != '#' && (strncmp(line, p->name, len) || line[len] != ' '))
+			fputs(line, out);
+	}
+	if (in)
+		fclose(in);
+
+	fprintf(out, "%s %04x %d %d %d %d %d %d\n", p->name, p->devid,
+		p->delay[TUNE_PROG][0], p->delay[TUNE_PROG][1],
+		p->delay[TUNE_PAGE_ERASE][0], p->delay[TUNE_PAGE_ERASE][1],
+		p->delay[TUNE_MASS_ERASE][0], p->delay[TUNE_MASS_ERASE][1]);
+
+	/* a half written file must never be loaded, write aside and rename */
+	if (fclose(out) || rename(tmp, path) < 0) {
+		log_err("Writing %s failed: %s\n", path, strerror(errno));
+		return -1;
+	}
+
+	return 0;
+}
+
+/* quietly, icp_byte_verify() would log every miss as an error */
+static int tune_read_back(uint32_t addr, const uint8_t *data)
+{
+	uint8_t buf[TUNE_LEN];
+
+	icp_aprom_byte_read(addr, TUNE_LEN, buf);
+
+	return memcmp(buf, data, TUNE_LEN) ? -1 : 0;
+}
+
+/* one cycle of kind with the delays in the table, 0 if it read back right */
+static int tune_cycle(int kind, int rep)
+{
+	uint32_t last = icp_dev->flash_size - icp_dev->page_size;
+	uint8_t data[TUNE_LEN], blank[TUNE_LEN];
+
+	/* differs per repeat, and never 0xff, which an aborted write leaves */
+	for (int i = 0; i < TUNE_LEN; i++) {
+		data[i] = i * 7 + rep * 13;
+		if (data[i] == 0xff)
+			data[i] = 0x00;
+	}
+	memset(blank, 0xff, sizeof(blank));
+
+	switch (kind) {
+	case TUNE_PROG:
+		icp_aprom_page_erase(last);
+		icp_aprom_byte_write(last, TUNE_LEN, data);
+		return tune_read_back(last, data);
+	case TUNE_PAGE_ERASE:
+		icp_aprom_byte_write(last, TUNE_LEN, data);
+		icp_aprom_page_erase(last);
+		return tune_read_back(last, blank);
+	case TUNE_MASS_ERASE:
+		icp_aprom_byte_write(APROM_FLASH_ADDR, TUNE_LEN, data);
+		icp_aprom_byte_write(last, TUNE_LEN, data);
+		icp_mass_erase();
+		if (tune_read_back(APROM_FLASH_ADDR, blank) < 0)
+			return -1;
+		return tune_read_back(last, blank);
+	}
+
+	return -1;
+}
+
+/* delay1 of kind in p, with delay2 in the same ratio as in def */
+static void tune_scale(struct tune_profile *p, const struct tune_profile *def, int kind,
+		       int delay1)
+{
+	p->delay[kind][0] = delay1;
+	p->delay[kind][1] = (int64_t)def->delay[kind][1] * delay1 / def->delay[kind][0];
+	if (p->delay[kind][1] < 1)
+		p->delay[kind][1] = 1;
+}
+
+/* whether kind passes all repeats with delay1, the others at their defaults */
+static int tune_passes(struct icp_device *dev, const struct tune_profile *def, int kind,
+		       int delay1)
+{
+	struct tune_profile p = *def;
+	int ok = 1;
+
+	tune_scale(&p, def, kind, delay1);
+	tune_set(dev, &p);
+
+	for (int rep = 0; rep < TUNE_REPEATS && ok; rep++)
+		ok = tune_cycle(kind, rep) == 0;
+
+	log_debug("%s with %d us: %s\n", tune_kinds[kind], delay1, ok ? "pass" : "fail");
+	tune_set(dev, def);
+
+	return ok;
+}
+
+/*
+ * Calibrate the identified chip, which is erased by it, and store the
+ * result in path as profile name, the device name if NULL. The tuned
+ * delays are in effect afterwards. Returns <0 if the default timing
+ * itself fails or the profile cannot be stored.
+ */
+int tune_calibrate(struct icp_session *s, const char *path, const char *name)
+{
+	struct icp_device *dev = icp_tune_device(s->devid);
+	struct tune_profile def, tuned;
+
+	if (!name)
+		name = dev->name;
+	if (strlen(name) >= TUNE_NAME_MAX || strpbrk(name, " \t\n#")) {
+		log_err("Bad timing profile name '%s'\n", name);
+		return -1;
+	}
+
+	tune_get(dev, &def);
+	tuned = def;
+	snprintf(tuned.name, sizeof(tuned.name), "%s", name);
+	tuned.devid = dev->devid;
+
+	log_info("Calibrating the timing, this erases the chip\n");
+
+	/* the chip was erased by now and CONFIG with it */
+	s->have_cfg = 0;
+	s->erased = 0;
+
+	for (int kind = 0; kind < TUNE_KINDS; kind++) {
+		int lo = 0, hi = def.delay[kind][0], delay1;
+
+		if (!tune_passes(dev, &def, kind, hi)) {
+			log_err("%s fails with the default timing, not calibrated\n", tune_kinds[kind]);
+			return -1;
+		}
+
+		/* lo fails or is untested, hi passes */
+		while (hi - lo > 1 && hi - lo > hi / TUNE_RESOLUTION) {
+			int mid = lo + (hi - lo) / 2;
+
+			if (tune_passes(dev, &def, kind, mid))
+				hi = mid;
+			else
+				lo = mid;
+		}
+
+		delay1 = hi + hi * TUNE_MARGIN_PCT / 100;
+		if (delay1 > def.delay[kind][0])
+			delay1 = def.delay[kind][0];
+		if (!tune_passes(dev, &def, kind, delay1)) {
+			log_info("%s unstable with margin, keeping the default\n", tune_kinds[kind]);
+			delay1 = def.delay[kind][0];
+		}
+
+		tune_scale(&tuned, &def, kind, delay1);
+		log_info("%s: passes down to %d us, %d/%d us with margin (default %d/%d us)\n",
+			 tune_kinds[kind], hi, tuned.delay[kind][0], tuned.delay[kind][1],
+			 def.delay[kind][0], def.delay[kind][1]);
+	}
+
+	tune_set(dev, &tuned);
+	tune_print("Calibrated profile", &tuned, dev->name);
+
+	return tune_store(path, &tuned);
+}
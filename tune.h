@@ -0,0 +1,15 @@
+/*
+ * nuvoicp - timing profiles and their calibration
+ *
+ * Distributed under the same terms as nuvoicp.c, see there.
+ */
+
+#ifndef TUNE_H
+#define TUNE_H
+
+struct icp_session;
+
+int tune_load(const char *path, const char *name);
+int tune_calibrate(struct icp_session *s, const char *path, const char *name);
+
+#endif
@@ -0,0 +1,100 @@
+/*
+ * nuvoicp - precompiled ICP waveforms
+ *
+ * Bulk transfers are compiled into an array of line states and delays
+ * first and then played out by pgm_play() in one tight loop. Building
+ * the steps costs the same for every backend, playing them is little
+ * more than one backend call per step, so throughput and timing depend
+ * on the backend alone.
+ *
+ * The steps come out exactly like icp_bitsend() and icp_write_byte()
+ * would drive the lines, except that a step without delay which the
+ * next one overrides anyway is dropped, as long as it does not raise
+ * CLK. That saves the separate falling edges before the end bit and
+ * before the next byte.
+ *
+ * Distributed under the same terms as nuvoicp.c, see there.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "wave.h"
+#include "perf.h"
+#include "ctx.h"
+
+void wave_reset(struct wave *w)
+{
+	w->num_steps = 0;
+	w->marks = 0;
+	w->bits = 0;
+	w->bytes = 0;
+}
+
+static void wave_step(struct wave *w, unsigned int mask, unsigned int vals,
+		      unsigned int marks, uint32_t delay_us)
+{
+	struct pgm_step *prev = w->num_steps ? &w->steps[w->num_steps - 1] : NULL;
+
+	/* marks alone go with the next step */
+	marks |= w->marks;
+	w->marks = 0;
+	if (!mask) {
+		w->marks = marks;
+		return;
+	}
+
+	if (prev && !prev->delay_us && !(prev->vals & PGM_CLK) &&
+	    (mask & prev->mask) == prev->mask) {
+		marks |= prev->marks;
+		w->num_steps--;
+	}
+
+	w->steps[w->num_steps++] = (struct pgm_step) {
+		.mask = mask, .vals = vals, .marks = marks, .delay_us = delay_us,
+	};
+}
+
+/* like icp_bitsend(), MSB first with the data set up on the falling edge */
+void wave_bits(struct wave *w, uint32_t data, int len)
+{
+	unsigned int marks = PGM_BREAK_BIT;
+
+	w->bits += len;
+	while (len--) {
+		wave_step(w, PGM_DAT | PGM_CLK, (data >> len) & 1 ? PGM_DAT : 0, marks, 0);
+		wave_step(w, PGM_CLK, PGM_CLK, 0, 0);
+		marks = PGM_MARK_BIT;
+	}
+	wave_step(w, PGM_CLK, 0, marks, 0);
+}
+
+void wave_command(struct wave *w, uint8_t cmd, uint32_t dat)
+{
+	uint32_t command = (dat << 6) | cmd;
+
+	wave_step(w, 0, 0, PGM_BREAK_BYTE, 0);
+	wave_bits(w, command, 24);
+}
+
+/* like icp_write_byte(), the end bit is clocked with the program delays */
+void wave_write_byte(struct wave *w, uint8_t data, int end, int delay1, int delay2)
+{
+	wave_step(w, 0, 0, PGM_MARK_BYTE, 0);
+	wave_bits(w, data, 8);
+	wave_step(w, PGM_DAT | PGM_CLK, end ? PGM_DAT : 0, 0, delay1);
+	wave_step(w, PGM_CLK, PGM_CLK, 0, delay2);
+	wave_step(w, PGM_DAT | PGM_CLK, 0, 0, 0);
+
+	w->bits++;
+	w->bytes++;
+}
+
+void wave_play(struct wave *w)
+{
+	perf_count(bits, w->bits);
+	perf_count(bytes_written, w->bytes);
+
+	pgm_dat_dir(1);
+	pgm_play(w->steps, w->num_steps);
+}
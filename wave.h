@@ -0,0 +1,32 @@
+/*
+ * nuvoicp - precompiled ICP waveforms
+ *
+ * Distributed under the same terms as nuvoicp.c, see there.
+ */
+
+#ifndef WAVE_H
+#define WAVE_H
+
+#include <stdint.h>
+
+#include "pgm.h"
+
+/* enough for a command and a page of byte writes */
+#define WAVE_MAX_BYTES		256
+#define WAVE_MAX_STEPS		(2 * 24 + 1 + WAVE_MAX_BYTES * (2 * 8 + 3))
+
+struct wave {
+	struct pgm_step steps[WAVE_MAX_STEPS];
+	int num_steps;
+	unsigned int marks;	/* for the next step */
+	uint32_t bits;
+	uint32_t bytes;
+};
+
+void wave_reset(struct wave *w);
+void wave_bits(struct wave *w, uint32_t data, int len);
+void wave_command(struct wave *w, uint8_t cmd, uint32_t dat);
+void wave_write_byte(struct wave *w, uint8_t data, int end, int delay1, int delay2);
+void wave_play(struct wave *w);
+
+#endif